@@ -54,41 +54,73 @@ void FITS_reporterr(int *errcode){
 /**
  * Functions to make intensity transforms of different kinds
  * Carefully! All they valid only @[0,1]!!!
+ * Transforms which can't be vectorized are calculated by look-up table with linear
+ * interpolation between nodes
  */
-static double lintrans(double in){
-    return in;
-}
-static double logtrans(double in){ // logaryphmic
-    return log(1. + in);
-}
-double exptrans(double in){ // exponential
-    return exp(in - 1.);
-}
-double powtrans(double in){ // x^2
-    return in*in;
-}
-double sqrtrans(double in){ // square root
-    return sqrt(in);
+// amount of intervals in LUT of intensity transforms (LUT should fit L2 cache)
+#define TRANSF_LUTSIZE      (1<<14)
+// amount of pixels processed by one SIMD loop
+#define TRANSF_BLKSZ        (1024)
+// default parameters of transforms
+#define TRANSF_GAMMA_DEF    (2.2)
+#define TRANSF_ASINH_DEF    (10.)
+#define TRANSF_SINH_DEF     (3.)
+
+/**
+ * @brief transfval - calculate value of intensity transform
+ * @param transf - type of transform
+ * @param in     - input value
+ * @param par    - parameter of transform (gamma for TRANSF_GAMMA, softening for TRANSF_ASINH
+ *      and TRANSF_SINH)
+ * @return transformed value
+ */
+static double transfval(intens_transform transf, double in, double par){
+    switch(transf){
+        case TRANSF_LOG: // logaryphmic
+            return log(1. + in);
+        case TRANSF_EXP: // exponential
+            return exp(in - 1.);
+        case TRANSF_POW: // x^2
+            return in*in;
+        case TRANSF_SQR: // square root
+            return sqrt(in);
+        case TRANSF_ASINH: // asinh(par*x) normalized to 1 @x=1
+            return asinh(par * in) / asinh(par);
+        case TRANSF_GAMMA: // x^(1/gamma)
+            return pow(in, 1. / par);
+        case TRANSF_SINH: // sinh(par*x) normalized to 1 @x=1
+            return sinh(par * in) / sinh(par);
+        default:
+            return in;
+    }
 }
 
-typedef double (*transfunct)(double in);
-static transfunct tfunctions[TRANSF_COUNT] = {
-    [TRANSF_EXP] = exptrans,
-    [TRANSF_LOG] = logtrans,
-    [TRANSF_LINEAR] = lintrans,
-    [TRANSF_POW] = powtrans,
-    [TRANSF_SQR] = sqrtrans
-};
+// default parameter of transform
+static double transfpar(intens_transform transf, double par){
+    if(par > 0.) return par;
+    switch(transf){
+        case TRANSF_GAMMA:
+            return TRANSF_GAMMA_DEF;
+        case TRANSF_ASINH:
+            return TRANSF_ASINH_DEF;
+        case TRANSF_SINH:
+            return TRANSF_SINH_DEF;
+        default:
+            return 0.;
+    }
+}
 
 /**
- * @brief mktransform - make image intensity transformation
- * @param dimg (io) - double image
- * @param st   (i)  - image statistics
- * @param transf    - type of transformation
+ * @brief mktransform_par - make image intensity transformation with given parameter
+ * @param im (io) - double image
+ * @param st (i)  - image statistics
+ * @param transf  - type of transformation
+ * @param par     - parameter of transform: gamma for TRANSF_GAMMA, softening for TRANSF_ASINH
+ *      and TRANSF_SINH (<= 0 for default value)
  * @return NULL if failed
  *      Be carefull: image should be equalized before some types of transform
  */
-doubleimage *mktransform(doubleimage *im, imgstat *st, intens_transform transf){
+doubleimage *mktransform_par(doubleimage *im, imgstat *st, intens_transform transf, double par){
     if(!im || !im->data || !st || transf <= TRANSF_WRONG || transf >= TRANSF_COUNT) return NULL;
     double max = st->max, min = st->min;
     if((max-min) < 2.*DBL_EPSILON){
@@ -97,17 +129,71 @@ doubleimage *mktransform(doubleimage *im, imgstat *st, intens_transform transf){
     }
     double *dimg = im->data;
     if(transf == TRANSF_LINEAR) return im; // identity
-    double (*transfn)(double in) = tfunctions[transf];
-    if(!transfn) ERRX(_("Given transform type not supported yet"));
+    par = transfpar(transf, par);
     size_t totpix = im->totpix;
+#ifdef EBUG
+    double t0 = dtime();
+#endif
+    initomp();
+    if(transf == TRANSF_POW || transf == TRANSF_SQR){ // these are vectorized as is
+        bool pw = (transf == TRANSF_POW);
+        OMP_FOR()
+        for(size_t b = 0; b < totpix; b += TRANSF_BLKSZ){
+            double *d = &dimg[b];
+            size_t e = MIN(TRANSF_BLKSZ, totpix - b);
+            OMP_SIMD()
+            for(size_t i = 0; i < e; ++i){
+                double x = d[i] - min;
+                x = (x > 0.) ? x : 0.;
+                x = pw ? x*x : sqrt(x);
+                d[i] = isnan(d[i]) ? d[i] : x;
+            }
+        }
+        DBG("time for transform: %gs", dtime() - t0);
+        return im;
+    }
+    // LUT for values (x - min) in [0, max - min]; gamma have infinite derivative at zero,
+    // so its LUT is indexed by sqrt((x - min) / (max - min)) to make nodes denser there
+    bool sq = (transf == TRANSF_GAMMA);
+    double range = max - min, *lut = MALLOC(double, TRANSF_LUTSIZE + 1);
+    for(size_t i = 0; i <= TRANSF_LUTSIZE; ++i){
+        double u = (double)i / TRANSF_LUTSIZE;
+        lut[i] = transfval(transf, range * (sq ? u*u : u), par);
+    }
+    double dn = (double)TRANSF_LUTSIZE;
     OMP_FOR()
-    for(size_t i = 0; i < totpix; ++i){
-        double d = dimg[i] - min;
-        dimg[i] = transfn(d);
+    for(size_t b = 0; b < totpix; b += TRANSF_BLKSZ){
+        double *d = &dimg[b];
+        size_t e = MIN(TRANSF_BLKSZ, totpix - b);
+        OMP_SIMD()
+        for(size_t i = 0; i < e; ++i){
+            double x = (d[i] - min) / range;
+            x = (x >= 0.) ? x : 0.;
+            x = (x <= 1.) ? x : 1.;
+            x = (sq ? sqrt(x) : x) * dn;
+            size_t v = (size_t)x;
+            v = (v < TRANSF_LUTSIZE) ? v : TRANSF_LUTSIZE - 1;
+            double r = lut[v] + (lut[v+1] - lut[v]) * (x - v);
+            d[i] = isnan(d[i]) ? d[i] : r;
+        }
     }
+    FREE(lut);
+    DBG("time for transform: %gs", dtime() - t0);
     return im;
 }
 
+/**
+ * @brief mktransform - make image intensity transformation
+ * @param dimg (io) - double image
+ * @param st   (i)  - image statistics
+ * @param transf    - type of transformation
+ * @return NULL if failed
+ *      Be carefull: image should be equalized before some types of transform
+ */
+doubleimage *mktransform(doubleimage *im, imgstat *st, intens_transform transf){
+    return mktransform_par(im, st, transf, 0.);
+}
+
 /**
  * @brief palette_gray - simplest gray conversion
  * @param gray  - nornmalized double value
@@ -253,24 +339,114 @@ static palette palette_F[PALETTE_COUNT] = {
     [PALETTE_JET] = palette_jet
 };
 
+/*
+ * All palettes are tabulated once into PALETTE_SIZE RGBA entries, so conversion is
+ * quantization of value (vectorized) and gather of 4 bytes per pixel
+ */
+// amount of entries in palette tables (all tables should fit L2 cache)
+#define PALETTE_SIZE        (4096)
+// amount of pixels processed by one SIMD loop
+#define PALETTE_BLKSZ       (1024)
+
+static uint8_t palette_tables[PALETTE_COUNT][PALETTE_SIZE][4];
+
+// fill palette tables (once; callers may run in different threads)
+static void mkpalettes(){
+    static bool got = FALSE;
+    #pragma omp critical (mkpalettes)
+    {
+        if(!got){
+            for(int p = PALETTE_WRONG + 1; p < PALETTE_COUNT; ++p){
+                palette f = palette_F[p];
+                if(!f) continue;
+                for(int i = 0; i < PALETTE_SIZE; ++i){
+                    f((double)i / (PALETTE_SIZE - 1), palette_tables[p][i]);
+                    palette_tables[p][i][3] = 255; // opaque
+                }
+            }
+            got = TRUE;
+        }
+    }
+}
+
 /**
- * @brief convert2palette - convert normalized double image into colour using some palette
- * @param im (i) - image to convert
- * @param cmap   - palette (colormap) used
- * @return allocated here array with color image
+ * @brief palette_table - get tabulated palette
+ * @param cmap - palette (colormap)
+ * @return array of PALETTE_SIZE RGBA entries for values i/(PALETTE_SIZE-1) or NULL if failed
  */
-uint8_t *convert2palette(doubleimage *im, image_palette cmap){
-    if(!im || !im->data || cmap <= PALETTE_WRONG || cmap >= PALETTE_COUNT) return NULL;
-    palette impalette = palette_F[cmap];
-    if(impalette == NULL) ERRX(_("Given colormap doesn't support yet"));
+const uint8_t *palette_table(image_palette cmap){
+    if(cmap <= PALETTE_WRONG || cmap >= PALETTE_COUNT) return NULL;
+    if(palette_F[cmap] == NULL) ERRX(_("Given colormap doesn't support yet"));
+    mkpalettes();
+    return palette_tables[cmap][0];
+}
+
+/**
+ * @brief palette_convert - convert normalized values into colour
+ * @param in (i)  - values (would be clamped to [0, 1], NaN is treated as 0)
+ * @param n       - their amount
+ * @param tab (i) - palette table (from palette_table())
+ * @param out (o) - output: 3 (RGB) or 4 (RGBA) bytes per pixel
+ * @param rgba    - TRUE for RGBA output
+ */
+void palette_convert(const double *in, size_t n, const uint8_t *tab, uint8_t *out, bool rgba){
+    uint32_t idx[PALETTE_BLKSZ];
+    size_t bpp = rgba ? 4 : 3;
+    const double dn = PALETTE_SIZE - 1;
+    for(size_t b = 0; b < n; b += PALETTE_BLKSZ){
+        const double *d = &in[b];
+        size_t e = MIN(PALETTE_BLKSZ, n - b);
+        OMP_SIMD()
+        for(size_t i = 0; i < e; ++i){
+            double x = d[i] * dn + 0.5;
+            x = (x >= 0.) ? x : 0.;
+            x = (x <= dn) ? x : dn;
+            idx[i] = (uint32_t)x;
+        }
+        uint8_t *o = &out[b * bpp];
+        if(rgba){
+            for(size_t i = 0; i < e; ++i) memcpy(&o[4*i], &tab[4*idx[i]], 4);
+        }else{ // write 4 bytes per pixel: 4th byte would be overwritten by next pixel
+            for(size_t i = 0; i + 1 < e; ++i) memcpy(&o[3*i], &tab[4*idx[i]], 4);
+            memcpy(&o[3*(e-1)], &tab[4*idx[e-1]], 3);
+        }
+    }
+}
+
+// convert image into RGB or RGBA
+static uint8_t *convert_image(doubleimage *im, image_palette cmap, bool rgba){
+    if(!im || !im->data) return NULL;
+    const uint8_t *tab = palette_table(cmap);
+    if(!tab) return NULL;
     size_t totpix = im->totpix;
     if(totpix == 0) return NULL;
-    double *inarr = im->data;
-    uint8_t *colored = MALLOC(uint8_t, totpix * 3);
+    size_t bpp = rgba ? 4 : 3, nblocks = (totpix + PALETTE_BLKSZ - 1) / PALETTE_BLKSZ;
+    uint8_t *colored = MALLOC(uint8_t, totpix * bpp);
     initomp();
     OMP_FOR()
-    for(size_t i = 0; i < totpix; ++i){
-        impalette(inarr[i], &colored[i*3]);
+    for(size_t b = 0; b < nblocks; ++b){
+        size_t first = b * PALETTE_BLKSZ;
+        palette_convert(&im->data[first], MIN(PALETTE_BLKSZ, totpix - first), tab, &colored[first * bpp], rgba);
     }
     return colored;
 }
+
+/**
+ * @brief convert2palette - convert normalized double image into colour using some palette
+ * @param im (i) - image to convert
+ * @param cmap   - palette (colormap) used
+ * @return allocated here array with color image (3 bytes per pixel)
+ */
+uint8_t *convert2palette(doubleimage *im, image_palette cmap){
+    return convert_image(im, cmap, FALSE);
+}
+
+/**
+ * @brief convert2palette_rgba - convert normalized double image into colour with alpha channel
+ * @param im (i) - image to convert
+ * @param cmap   - palette (colormap) used
+ * @return allocated here array with color image (4 bytes per pixel, alpha is 255)
+ */
+uint8_t *convert2palette_rgba(doubleimage *im, image_palette cmap){
+    return convert_image(im, cmap, TRUE);
+}
@@ -30,6 +30,7 @@
 
 #define Stringify(x) #x
 #define OMP_FOR(...) _Pragma(Stringify(omp parallel for __VA_ARGS__))
+#define OMP_SIMD(...) _Pragma(Stringify(omp simd __VA_ARGS__))
 #ifndef MAX
 #define MAX(x,y) ((x) > (y) ? (x) : (y))
 #endif
@@ -62,7 +63,8 @@ typedef struct klist_{
     int keyclass;               // key class [look int CFITS_API ffgkcl(char *tcard) ]
 	char *record;               // record itself
 	struct klist_ *next;        // next record
-	struct klist_ *last;        // previous record
+	struct klist_ *last;        // last record (only in first record)
+	struct keyindex_ *index;    // hash index of keywords (only in first record, built with list)
 } KeyList;
 
 /**
@@ -116,6 +118,7 @@ typedef struct{
     double std;
     double min;
     double max;
+    double median;  // NAN if not calculated
 } imgstat;
 
 // type of intensity transformation
@@ -126,6 +129,9 @@ typedef enum{
     TRANSF_EXP,
     TRANSF_POW,
     TRANSF_SQR,
+    TRANSF_ASINH,
+    TRANSF_GAMMA,
+    TRANSF_SINH,
     TRANSF_COUNT // amount of transforms
 } intens_transform;
 
@@ -140,6 +146,118 @@ typedef enum{
     PALETTE_COUNT // amount of palettes
 } image_palette;
 
+// rectangular region of image
+typedef struct{
+    size_t x0;          // left column
+    size_t y0;          // bottom row
+    size_t w;           // width
+    size_t h;           // height
+} imregion;
+
+// direction of image projection
+typedef enum{
+    PROJ_ROWS,          // one value per each row
+    PROJ_COLUMNS        // one value per each column
+} proj_axis;
+
+// type of projection
+typedef enum{
+    PROJ_WRONG = 0,
+    PROJ_SUM,
+    PROJ_MEAN,
+    PROJ_MEDIAN,
+    PROJ_CLIPMEAN,      // sigma-clipped mean
+    PROJ_COUNT
+} proj_type;
+
+// processing of image borders in filters
+typedef enum{
+    BORDER_NONE = 0,    // don't process borders (copy input pixels)
+    BORDER_REFLECT,     // mirror image relative to its edge (...cba|abc...)
+    BORDER_REPLICATE,   // repeat edge pixels (...aaa|abc...)
+    BORDER_CONSTANT,    // all pixels outside image have given value
+    BORDER_SHRINK,      // use only pixels inside image
+    BORDER_COUNT
+} border_mode;
+
+// median filter for image cubes (see median.c)
+typedef struct cubemedian_ cubemedian;
+
+// type of pixel-wise combination of images
+typedef enum{
+    COMBINE_WRONG = 0,
+    COMBINE_MEAN,
+    COMBINE_MEDIAN,
+    COMBINE_CLIPMEAN,   // sigma-clipped mean
+    COMBINE_MINMAX,     // mean after rejection of `nlow` smallest and `nhigh` largest values
+    COMBINE_COUNT
+} combine_type;
+
+// parameters of combination
+typedef struct{
+    combine_type type;
+    double nsigma;      // clipping limit (in STD) for COMBINE_CLIPMEAN
+    int nlow;           // amount of rejected smallest values for COMBINE_MINMAX
+    int nhigh;          // amount of rejected largest values for COMBINE_MINMAX
+    size_t membudget;   // max size of input buffers in bytes (0 - default)
+} combine_pars;
+
+// type of block reduction for image pyramid
+typedef enum{
+    PYRAMID_WRONG = 0,
+    PYRAMID_MEAN,
+    PYRAMID_MAX,
+    PYRAMID_MEDIAN,
+    PYRAMID_COUNT
+} pyramid_type;
+
+// multi-resolution image pyramid
+typedef struct{
+    size_t nlevels;         // amount of levels
+    doubleimage **levels;   // levels[k] is image reduced 2^(k+1) times
+} dblpyramid;
+
+// parameters of display pipeline
+typedef struct{
+    double min;             // limits of data: if max > min they are used instead of calculated
+    double max;
+    bool zscale;            // calculate limits by zscale instead of min/max
+    double contrast;        // zscale contrast (<= 0 for default)
+    bool histeq;            // make histogram equalisation
+    double fracbtm;         // fractions of pixels for histogram cut-off from bottom
+    double fractop;         // and from top
+    size_t nlevls;          // amount of histogram levels for equalisation and cut-off
+    intens_transform transf;// intensity transform (TRANSF_WRONG means linear)
+    double transfpar;       // its parameter (<= 0 for default)
+    image_palette cmap;     // palette (PALETTE_WRONG means gray)
+    bool rgba;              // output have 4 bytes per pixel instead of 3
+    size_t nsamples;        // max amount of pixels for statistics (0 - default)
+} display_pars;
+
+// display pipeline (opaque)
+typedef struct display_ display;
+
+// stretch of RGB composite
+typedef enum{
+    RGBSTRETCH_WRONG = 0,
+    RGBSTRETCH_CHANNEL,     // intensity transform of each channel
+    RGBSTRETCH_LUPTON,      // colour-preserving asinh stretch of total intensity (Lupton et al.)
+    RGBSTRETCH_COUNT
+} rgb_stretch;
+
+// parameters of RGB composite
+typedef struct{
+    rgb_stretch stretch;    // type of stretch
+    double min[3];          // limits of R, G and B channels: if max > min they are used
+    double max[3];          //      instead of calculated
+    bool zscale;            // calculate limits by zscale instead of min/max
+    double contrast;        // zscale contrast (<= 0 for default)
+    intens_transform transf;// transform of channels for RGBSTRETCH_CHANNEL (TRANSF_WRONG means linear)
+    double transfpar;       // its parameter or softening Q for RGBSTRETCH_LUPTON (<= 0 for default)
+    double weight[3];       // weights of channels for RGBSTRETCH_LUPTON (<= 0 means 1)
+    size_t nsamples;        // max amount of pixels for statistics (0 - default)
+} rgb_pars;
+
 typedef union{
     FITSimage *image;
     FITStable *table;
@@ -160,6 +278,7 @@ typedef struct{
     int NHDUs;          // HDU amount
     FITSHDU *HDUs;      // HDUs array itself
     FITSHDU *curHDU;    // pointer to current HDU
+    bool storestat;     // store image statistics in headers by FITS_write
 } FITS;
 
 typedef struct{
@@ -167,14 +286,33 @@ typedef struct{
     size_t size;        // amount of levels
     size_t totpix;      // total amount of pixels
     double *levels;     // levels (for histograms of double images) for each H value
+    bool uniform;       // levels are uniform in [0, 1] (histogram of normalized image)
 }histogram;
 
+// look-up table for intensity remapping
+typedef struct{
+    double *values;     // new values for levels boundaries (size+1 values)
+    double *levels;     // levels boundaries for non-uniform histograms (NULL if uniform in [0, 1])
+    size_t size;        // amount of levels
+} histlut;
+
+// spacing of histogram bins
+typedef enum{
+    HIST_UNIFORM,
+    HIST_LOG,           // logarithmic
+    HIST_ASINH,         // linear near zero, logarithmic for large values
+    HIST_BINNING_COUNT
+} hist_binning;
+
 /**************************************************************************************
  *                                 fitskeywords.c                                     *
  **************************************************************************************/
 void keylist_free(KeyList **list);
 KeyList *keylist_add_record(KeyList **list, char *rec, int check);
+// keylist_find_key() matches full key name only (trailing spaces ignored, HIERARCH - up
+// to '='); to find key by beginning of its name use keylist_find_prefix()
 KeyList *keylist_find_key(KeyList *list, char *key);
+KeyList *keylist_find_prefix(KeyList *list, char *prefix);
 char *record_get_keyval(char *r, char **comm);
 char *keylist_find_keyval(KeyList *l, char *key, char **comm);
 void keylist_remove_key(KeyList **list, char *key);
@@ -211,8 +349,13 @@ FITSimage *image_copy(FITSimage *in);
 doubleimage *doubleimage_new(size_t w, size_t h);
 void doubleimage_free(doubleimage **im);
 doubleimage *image2double(FITSimage *img);
+bool image_pix2double(const FITSimage *img, size_t first, size_t n, double *dst);
+bool image_pix2double_block(const FITSimage *img, size_t first, size_t n, double *dst);
 imgstat *get_imgstat(const doubleimage *dimg, imgstat *est);
 doubleimage *normalize_dbl(doubleimage *dimg, imgstat *st);
+imgstat *image_fullstat(FITSimage *img, imgstat *st);
+bool image_stat_store(FITSHDU *hdu, imgstat *st);
+imgstat *image_stat_cached(FITSHDU *hdu, imgstat *st);
 //FITSimage *image_build(size_t h, size_t w, int dtype, uint8_t *indata);
 
 /**************************************************************************************
@@ -233,22 +376,108 @@ bool file_absent(char *name);
 void FITS_reporterr(int *errcode);
 void initomp();
 doubleimage *mktransform(doubleimage *im, imgstat *st, intens_transform transf);
+doubleimage *mktransform_par(doubleimage *im, imgstat *st, intens_transform transf, double par);
 uint8_t *convert2palette(doubleimage *im, image_palette cmap);
+uint8_t *convert2palette_rgba(doubleimage *im, image_palette cmap);
+const uint8_t *palette_table(image_palette cmap);
+void palette_convert(const double *in, size_t n, const uint8_t *tab, uint8_t *out, bool rgba);
 
 /**************************************************************************************
  *                                   histogram.c                                      *
  **************************************************************************************/
 void histogram_free(histogram **H);
 histogram *dbl2histogram(doubleimage *im, size_t nvalues);
+histogram *int2histogram(const FITSimage *img);
+histogram *image_histogram(const FITSimage *img, double *min, double *max);
+double *hist_mkedges(hist_binning type, size_t nbins, double min, double max, double scale);
+histogram *dbl2histogram_edges(const doubleimage *im, const double *edges, size_t nbins);
+histlut *histlut_new(size_t nlevels);
+void histlut_free(histlut **L);
+histlut *hist2lut_cutoff(const histogram *H, double fracbtm, double fractop);
+histlut *hist2lut_equalize(const histogram *H);
+histlut *hist2lut_match(const histogram *H, const histogram *ref);
+doubleimage *dbl_applylut(doubleimage *im, const histlut *L);
+doubleimage *image_applylut(const FITSimage *img, const histlut *L);
 doubleimage *dbl_histcutoff(doubleimage *im, size_t nlevls, double fracbtm, double fractop);
 doubleimage *dbl_histeq(doubleimage *im, size_t nlevls);
+doubleimage *dbl_histcutoff_edges(doubleimage *im, const double *edges, size_t nbins, double fracbtm, double fractop);
+doubleimage *dbl_histeq_edges(doubleimage *im, const double *edges, size_t nbins);
+doubleimage *dbl_clahe(doubleimage *im, size_t ntilesx, size_t ntilesy, size_t nlevls, double cliplimit);
 
 /**************************************************************************************
  *                                     median.c                                       *
  **************************************************************************************/
 doubleimage *get_median(const doubleimage *img, size_t radius);
-//doubleimage *get_adaptive_median(const doubleimage *img, size_t radius);
+doubleimage *get_median_border(const doubleimage *img, size_t radius, border_mode mode, double cval);
+FITSimage *get_median_int(FITSimage *img, size_t radius, border_mode mode, double cval);
+doubleimage *get_adaptive_median(const doubleimage *img, size_t radius);
+cubemedian *cubemedian_new(size_t w, size_t h, size_t tradius, size_t sradius);
+void cubemedian_free(cubemedian **cm);
+bool cubemedian_push(cubemedian *cm, const double *plane, double *out);
+bool cubemedian_flush(cubemedian *cm, double *out);
+FITSimage *get_cube_median(FITSimage *cube, size_t tradius, size_t sradius);
 double quick_select(const double *idata, int n);
 double calc_median(const double *idata, int n);
+double calc_median_buf(const double *idata, size_t n, double *buf);
+double dbl_select(double *a, size_t n, size_t k);
+float flt_select(float *a, size_t n, size_t k);
+uint16_t u16_select(uint16_t *a, size_t n, size_t k);
+uint32_t u32_select(uint32_t *a, size_t n, size_t k);
+void dbl_multiselect(double *a, size_t n, const size_t *k, size_t nk);
+void flt_multiselect(float *a, size_t n, const size_t *k, size_t nk);
+void u16_multiselect(uint16_t *a, size_t n, const size_t *k, size_t nk);
+void u32_multiselect(uint32_t *a, size_t n, const size_t *k, size_t nk);
+
+/**************************************************************************************
+ *                                   projection.c                                     *
+ **************************************************************************************/
+double *dbl_projection(const doubleimage *im, proj_axis axis, proj_type type, const imregion *reg, double nsigma);
+
+/**************************************************************************************
+ *                                    combine.c                                       *
+ **************************************************************************************/
+FITSimage *combine_images(FITSimage **images, int N, const combine_pars *pars);
+FITSimage *combine_files(char **filenames, int N, const combine_pars *pars);
+
+/**************************************************************************************
+ *                                   display.c                                        *
+ **************************************************************************************/
+display *display_new(const display_pars *pars);
+void display_free(display **d);
+uint8_t *display_render(display *d, const FITSimage *img, uint8_t *out);
+imgstat *image_zscale(const FITSimage *img, double contrast, size_t nsamples, imgstat *st);
+imgstat *dbl_zscale(const doubleimage *im, double contrast, size_t nsamples, imgstat *st);
+uint8_t *make_rgb_composite(const FITSimage *r, const FITSimage *g, const FITSimage *b,
+                            const rgb_pars *pars, uint8_t *out);
+uint8_t *dbl_rgb_composite(const doubleimage *r, const doubleimage *g, const doubleimage *b,
+                           const rgb_pars *pars, uint8_t *out);
+
+/**************************************************************************************
+ *                                   pyramid.c                                        *
+ **************************************************************************************/
+void dblpyramid_free(dblpyramid **p);
+dblpyramid *dbl_pyramid(const doubleimage *im, pyramid_type type, size_t nlevels);
+dblpyramid *image_pyramid(const FITSimage *img, pyramid_type type, size_t nlevels);
+bool FITS_addpyramid(FITS *fits, const dblpyramid *P);
+
+/**************************************************************************************
+ *                                   imwrite.c                                        *
+ **************************************************************************************/
+bool write_png(const char *filename, const uint8_t *data, size_t w, size_t h, int nchannels, int bitdepth);
+bool write_pnm(const char *filename, const uint8_t *data, size_t w, size_t h, int nchannels, int bitdepth);
+
+/**************************************************************************************
+ *                                   geometry.c                                       *
+ **************************************************************************************/
+FITSimage *image_crop(const FITSimage *img, const imregion *r);
+doubleimage *dbl_crop(const doubleimage *im, const imregion *r);
+FITSimage *image_flip(FITSimage *img, bool flipx, bool flipy);
+doubleimage *dbl_flip(doubleimage *im, bool flipx, bool flipy);
+FITSimage *image_transpose(FITSimage *img);
+doubleimage *dbl_transpose(doubleimage *im);
+FITSimage *image_rot90(FITSimage *img, int nquarters);
+doubleimage *dbl_rot90(doubleimage *im, int nquarters);
+doubleimage *image_bin(const FITSimage *img, size_t bx, size_t by, bool mean);
+doubleimage *dbl_bin(const doubleimage *im, size_t bx, size_t by, bool mean);
 
 #endif // FITSMANIP_H__
@@ -0,0 +1,301 @@
+/*
+ * This file is part of the FITSmaniplib project.
+ * Copyright 2019  Edward V. Emelianov <edward.emelianoff@gmail.com>, <eddy@sao.ru>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "FITSmanip.h"
+#include "local.h"
+
+/**************************************************************************************
+ *                          Pixel-wise combination of images                          *
+ **************************************************************************************/
+/*
+ * Combination of N images of the same size (bias, dark and flat frames etc).
+ * Images are processed by chunks of rows: for each chunk data of all frames is
+ * converted to double (or read from files), then pixels of chunk are combined in
+ * parallel. So memory consumption (except output image) is limited by `membudget`.
+ * NaNs in input data are ignored.
+ */
+
+// default memory budget for input buffers
+#define COMBINE_MEMBUDGET   (1<<28)
+// max amount of iterations for sigma-clipped mean
+#define COMBINE_MAXITER     (5)
+
+// median of array (mean of two middle values for even `n`); array is reordered
+static double median_inplace(double *a, size_t n){
+    // sorting networks of calc_median_buf() give the same for these sizes
+    if(n < 10 || n == 16 || n == 25) return calc_median_buf(a, n, a);
+    size_t k = n / 2;
+    double m = dbl_select(a, n, k);
+    if(n & 1) return m;
+    double l = a[0]; // max of lower part
+    for(size_t i = 1; i < k; ++i) if(a[i] > l) l = a[i];
+    return (l + m) / 2.;
+}
+
+static double mean(const double *a, size_t n){
+    double s = 0.;
+    for(size_t i = 0; i < n; ++i) s += a[i];
+    return s / n;
+}
+
+/**
+ * @brief combine_pixel - combine values of one pixel
+ * @param buf (io) - values (would be changed)
+ * @param n        - their amount
+ * @param p (i)    - parameters
+ * @return combined value
+ */
+static double combine_pixel(double *buf, size_t n, const combine_pars *p){
+    if(n == 0) return NAN;
+    switch(p->type){
+        case COMBINE_MEAN:
+            return mean(buf, n);
+        case COMBINE_MEDIAN:
+            return median_inplace(buf, n);
+        case COMBINE_CLIPMEAN:
+            for(int iter = 0; iter < COMBINE_MAXITER && n > 2; ++iter){
+                double m = mean(buf, n), s2 = 0.;
+                for(size_t i = 0; i < n; ++i) s2 += (buf[i] - m) * (buf[i] - m);
+                double thres = p->nsigma * sqrt(s2 / (n - 1));
+                double med = median_inplace(buf, n); // clip around median: it's robust to outliers
+                size_t k = 0;
+                for(size_t i = 0; i < n; ++i)
+                    if(fabs(buf[i] - med) <= thres) buf[k++] = buf[i];
+                if(k == n || k == 0) break;
+                n = k;
+            }
+            return mean(buf, n);
+        case COMBINE_MINMAX:
+            if((size_t)(p->nlow + p->nhigh) >= n) return median_inplace(buf, n);
+            if(p->nlow) dbl_select(buf, n, p->nlow);
+            buf += p->nlow;
+            n -= p->nlow;
+            if(p->nhigh) dbl_select(buf, n, n - p->nhigh);
+            return mean(buf, n - p->nhigh);
+        default:
+            return NAN;
+    }
+}
+
+// source of data: image in memory or opened file
+typedef struct{
+    FITSimage *img;
+    FITS *fits;
+} combine_src;
+
+/**
+ * @brief read_rows - read rows of source image as double
+ * @param src (i) - source
+ * @param w       - image width
+ * @param y0      - first row
+ * @param nrows   - amount of rows
+ * @param dst (o) - output buffer
+ * @return FALSE if failed
+ */
+static bool read_rows(combine_src *src, size_t w, size_t y0, size_t nrows, double *dst){
+    size_t first = y0 * w, n = nrows * w;
+    if(src->fits){
+        int fst = 0, anynul = 0;
+        double nulval = NAN;
+        fits_read_img(src->fits->fp, TDOUBLE, first + 1, n, &nulval, dst, &anynul, &fst);
+        if(fst){
+            FITS_reporterr(&fst);
+            return FALSE;
+        }
+        return TRUE;
+    }
+    return image_pix2double(src->img, first, n, dst);
+}
+
+/**
+ * @brief combine_sources - combine images by chunks of rows
+ * @param src (i)   - sources
+ * @param N         - their amount
+ * @param naxis     - amount of image axes
+ * @param naxes (i) - image sizes
+ * @param p (i)     - parameters
+ * @return combined image (FLOAT_IMG) or NULL
+ */
+static FITSimage *combine_sources(combine_src *src, int N, int naxis, long *naxes, const combine_pars *p){
+    FITSimage *out = image_new(naxis, naxes, FLOAT_IMG);
+    if(!out || !out->data){
+        WARNX(_("Can't create output image"));
+        if(out) image_free(&out);
+        return NULL;
+    }
+    size_t w = naxes[0], h = out->totpix / w; // all higher dimensions are treated as rows
+    size_t budget = p->membudget ? p->membudget : COMBINE_MEMBUDGET;
+    size_t chunk = budget / (sizeof(double) * w * N);
+    if(chunk < 1) chunk = 1;
+    if(chunk > h) chunk = h;
+    size_t chunkpix = chunk * w;
+    DBG("Combine %d images %zdx%zd by chunks of %zd rows", N, w, h, chunk);
+    double *data = MALLOC(double, chunkpix * N);
+    float *odata = (float*)out->data;
+#ifdef EBUG
+    double t0 = dtime();
+#endif
+    initomp();
+    for(size_t y0 = 0; y0 < h; y0 += chunk){
+        size_t nrows = MIN(chunk, h - y0);
+        for(int i = 0; i < N; ++i){
+            if(!read_rows(&src[i], w, y0, nrows, &data[i * chunkpix])){
+                FREE(data);
+                image_free(&out);
+                return NULL;
+            }
+        }
+        float *o = &odata[y0 * w];
+        OMP_FOR()
+        for(size_t y = 0; y < nrows; ++y){
+            double *buf = MALLOC(double, N);
+            for(size_t x = y * w; x < (y + 1) * w; ++x){
+                size_t n = 0;
+                for(int i = 0; i < N; ++i){
+                    double v = data[i * chunkpix + x];
+                    if(!isnan(v)) buf[n++] = v;
+                }
+                o[x] = (float)combine_pixel(buf, n, p);
+            }
+            FREE(buf);
+        }
+    }
+    FREE(data);
+    DBG("time for combining of %d images: %gs", N, dtime() - t0);
+    return out;
+}
+
+// check parameters of combining
+static bool check_pars(int N, const combine_pars *p){
+    if(N < 1 || !p || p->type <= COMBINE_WRONG || p->type >= COMBINE_COUNT){
+        WARNX(_("Wrong parameters"));
+        return FALSE;
+    }
+    if(p->type == COMBINE_CLIPMEAN && p->nsigma <= 0.){
+        WARNX(_("Clipping limit should be positive"));
+        return FALSE;
+    }
+    if(p->type == COMBINE_MINMAX && (p->nlow < 0 || p->nhigh < 0)){
+        WARNX(_("Amount of rejected values can't be negative"));
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/**
+ * @brief combine_images - pixel-wise combination of images in memory
+ * @param images (i) - array of images (all should have the same size)
+ * @param N          - amount of images
+ * @param pars (i)   - parameters of combination
+ * @return new image (FLOAT_IMG) or NULL if failed
+ */
+FITSimage *combine_images(FITSimage **images, int N, const combine_pars *pars){
+    if(!images || !check_pars(N, pars)) return NULL;
+    FITSimage *first = images[0];
+    if(!first || !first->data || first->naxis < 2){
+        WARNX(_("Wrong image"));
+        return NULL;
+    }
+    combine_src *src = MALLOC(combine_src, N);
+    for(int i = 0; i < N; ++i){
+        FITSimage *img = images[i];
+        if(!img || !img->data || img->naxis != first->naxis ||
+                memcmp(img->naxes, first->naxes, sizeof(long)*first->naxis)){
+            WARNX(_("Image %d have wrong size"), i);
+            FREE(src);
+            return NULL;
+        }
+        src[i].img = img;
+    }
+    FITSimage *out = combine_sources(src, N, first->naxis, first->naxes, pars);
+    FREE(src);
+    return out;
+}
+
+/**
+ * @brief open_image_hdu - open file and move to first HDU with image inside
+ * @param filename    - file name
+ * @param naxis (o)   - amount of axes
+ * @param naxes (o)   - image sizes (allocated here)
+ * @return opened file or NULL
+ */
+static FITS *open_image_hdu(char *filename, int *naxis, long **naxes){
+    FITS *fits = FITS_open(filename);
+    if(!fits) return NULL;
+    int nhdus = 0, fst = 0, hdutype;
+    fits_get_num_hdus(fits->fp, &nhdus, &fst);
+    for(int i = 1; !fst && i <= nhdus; ++i){
+        if(fits_movabs_hdu(fits->fp, i, &hdutype, &fst)) break;
+        if(hdutype != IMAGE_HDU) continue;
+        int n = 0;
+        if(fits_get_img_dim(fits->fp, &n, &fst) || n < 2) continue;
+        *naxes = MALLOC(long, n);
+        int bitpix;
+        if(fits_get_img_param(fits->fp, n, &bitpix, naxis, *naxes, &fst)){
+            FREE(*naxes);
+            break;
+        }
+        return fits;
+    }
+    if(fst) FITS_reporterr(&fst);
+    WARNX(_("File %s don't contain images"), filename);
+    FITS_free(&fits);
+    return NULL;
+}
+
+/**
+ * @brief combine_files - pixel-wise combination of images from files
+ * In each file first image HDU is used; files are read by chunks of rows, so images
+ * don't need to fit into memory
+ * @param filenames (i) - array of file names
+ * @param N             - amount of files
+ * @param pars (i)      - parameters of combination
+ * @return new image (FLOAT_IMG) or NULL if failed
+ */
+FITSimage *combine_files(char **filenames, int N, const combine_pars *pars){
+    if(!filenames || !check_pars(N, pars)) return NULL;
+    combine_src *src = MALLOC(combine_src, N);
+    FITSimage *out = NULL;
+    int naxis = 0;
+    long *naxes = NULL;
+    int i;
+    for(i = 0; i < N; ++i){
+        int n;
+        long *sz = NULL;
+        src[i].fits = open_image_hdu(filenames[i], &n, &sz);
+        if(!src[i].fits) goto ret;
+        if(i == 0){
+            naxis = n;
+            naxes = sz;
+            continue;
+        }
+        bool good = (n == naxis && !memcmp(sz, naxes, sizeof(long)*naxis));
+        FREE(sz);
+        if(!good){
+            WARNX(_("Image in %s have wrong size"), filenames[i]);
+            ++i;
+            goto ret;
+        }
+    }
+    out = combine_sources(src, N, naxis, naxes, pars);
+ret:
+    while(--i >= 0) FITS_free(&src[i].fits);
+    FREE(naxes);
+    FREE(src);
+    return out;
+}
@@ -0,0 +1,686 @@
+/*
+ * This file is part of the FITSmaniplib project.
+ * Copyright 2019  Edward V. Emelianov <edward.emelianoff@gmail.com>, <eddy@sao.ru>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "FITSmanip.h"
+#include "local.h"
+
+/**************************************************************************************
+ *                          Display pipeline: image -> RGB                            *
+ **************************************************************************************/
+/*
+ * All stages of display conversion (normalization, histogram equalization and cut-off,
+ * intensity transform and palette) are functions of pixel value only, so their
+ * composition is tabulated into one RGBA table:
+ *  - for 8- and 16-bit images table is indexed by raw pixel value;
+ *  - for other types - by value normalized to limits, quantized to DISP_LUTSIZE steps.
+ * Statistics (limits and histogram) are calculated by sample of pixels, then image is
+ * converted in one parallel pass without full-size intermediate arrays.
+ * If histogram isn't used, table is rebuilt only when limits change.
+ */
+
+// amount of intervals in table for non-integer images (table should fit L2 cache)
+#define DISP_LUTSIZE        (1<<16)
+// default amount of pixels for statistics
+#define DISP_NSAMPLES       (1<<18)
+// pixels are sampled by chunks of this length
+#define DISP_SAMPLECHUNK    (64)
+// amount of pixels converted by one SIMD loop
+#define DISP_BLKSZ          (1024)
+
+struct display_{
+    display_pars p;
+    uint8_t *lut;       // RGBA table
+    size_t lutsize;     // amount of entries in `lut`
+    int lutdtype;       // data type for which `lut` was built (0 if none)
+    double lutmin;      // limits for which `lut` was built (only for TBYTE/TUSHORT)
+    double lutmax;
+    double min, max;    // limits of current image
+};
+
+/**
+ * @brief display_new - create display pipeline
+ * @param pars (i) - its parameters
+ * @return pipeline (allocated here) or NULL if failed
+ */
+display *display_new(const display_pars *pars){
+    if(!pars) return NULL;
+    display_pars p = *pars;
+    if(p.transf == TRANSF_WRONG) p.transf = TRANSF_LINEAR;
+    if(p.cmap == PALETTE_WRONG) p.cmap = PALETTE_GRAY;
+    if(p.transf >= TRANSF_COUNT || p.cmap >= PALETTE_COUNT ||
+            p.fracbtm < 0. || p.fractop < 0. || p.fracbtm + p.fractop >= 1.){
+        WARNX(_("Wrong parameters"));
+        return NULL;
+    }
+    if((p.histeq || p.fracbtm > 0. || p.fractop > 0.) && p.nlevls < 2){
+        WARNX(_("Histogram should have at least two levels"));
+        return NULL;
+    }
+    if(!palette_table(p.cmap)) return NULL;
+    if(p.nsamples == 0) p.nsamples = DISP_NSAMPLES;
+    display *d = MALLOC(display, 1);
+    d->p = p;
+    return d;
+}
+
+void display_free(display **d){
+    if(!d || !*d) return;
+    FREE((*d)->lut);
+    FREE(*d);
+}
+
+/*
+ * zscale limits (as in IRAF and DS9): pixels are sampled on regular grid, sorted and
+ * line is fitted to sorted sample with iterative rejection of deviant points; limits
+ * are median -/+ range of sample given by slope of line divided by contrast
+ */
+// default amount of pixels in zscale sample
+#define ZSC_NSAMPLES        (1000)
+// default contrast
+#define ZSC_CONTRAST        (0.25)
+// rejection threshold (in sigma)
+#define ZSC_KREJ            (2.5)
+// max amount of fitting iterations
+#define ZSC_MAXITER         (5)
+// max fraction of rejected pixels
+#define ZSC_MAXREJECT       (0.5)
+// min amount of pixels for fitting
+#define ZSC_MINPIX          (5)
+
+// value of pixel `i`
+static inline double pixval(const FITSimage *img, size_t i){
+    switch(img->dtype){
+        case TBYTE:
+            return ((const uint8_t*)img->data)[i];
+        case TUSHORT:
+            return ((const uint16_t*)img->data)[i];
+        case TUINT:
+            return ((const uint32_t*)img->data)[i];
+        case TULONG:
+            return ((const uint64_t*)img->data)[i];
+        case TFLOAT:
+            return ((const float*)img->data)[i];
+        case TDOUBLE:
+            return ((const double*)img->data)[i];
+        default:
+            return NAN;
+    }
+}
+
+static int cmpdbl(const void *a, const void *b){
+    double d1 = *(const double*)a, d2 = *(const double*)b;
+    return (d1 > d2) - (d1 < d2);
+}
+
+/**
+ * @brief zsc_fitline - fit line to sorted sample with iterative rejection
+ * @param s (i)     - sorted sample
+ * @param n         - its length
+ * @param flag (io) - working array (`n` elements)
+ * @param slope (o) - slope of line (per one sample)
+ * @return amount of good pixels after rejection
+ */
+static size_t zsc_fitline(const double *s, size_t n, uint8_t *flag, double *slope){
+    double xscale = 2. / (n - 1), a = 0., b = 0.; // line a + b*x, x in [-1, 1]
+    size_t ngood = n, minpix = MAX(ZSC_MINPIX, (size_t)(n * (1. - ZSC_MAXREJECT)));
+    memset(flag, 0, n);
+    for(int iter = 0; iter < ZSC_MAXITER; ++iter){
+        double sx = 0., sy = 0., sxx = 0., sxy = 0.;
+        for(size_t i = 0; i < n; ++i){
+            if(flag[i]) continue;
+            double x = i * xscale - 1.;
+            sx += x; sy += s[i]; sxx += x*x; sxy += x*s[i];
+        }
+        double det = ngood * sxx - sx * sx;
+        if(det <= 0.) break;
+        a = (sxx * sy - sx * sxy) / det;
+        b = (ngood * sxy - sx * sy) / det;
+        // residuals and their sigma
+        double s2 = 0.;
+        for(size_t i = 0; i < n; ++i){
+            if(flag[i]) continue;
+            double r = s[i] - (a + b * (i * xscale - 1.));
+            s2 += r*r;
+        }
+        double thres = ZSC_KREJ * sqrt(s2 / ngood);
+        // reject deviant pixels together with their neighbours
+        size_t nrej = 0;
+        for(size_t i = 0; i < n; ++i){
+            if(flag[i] == 1) continue;
+            double r = s[i] - (a + b * (i * xscale - 1.));
+            if(fabs(r) > thres){
+                flag[i] = 1;
+                if(i > 0 && !flag[i-1]) flag[i-1] = 2;
+                if(i + 1 < n && !flag[i+1]) flag[i+1] = 2;
+            }
+        }
+        ngood = 0;
+        for(size_t i = 0; i < n; ++i){
+            if(flag[i]){ flag[i] = 1; ++nrej; }
+            else ++ngood;
+        }
+        if(nrej == 0 || ngood < minpix) break;
+    }
+    *slope = b * xscale;
+    return ngood;
+}
+
+/**
+ * @brief zscale - calculate zscale limits by sample
+ * @param s (io)    - sample (would be sorted)
+ * @param n         - its length
+ * @param contrast  - contrast
+ * @param st (o)    - output: min/max - limits, median, mean and std - of sample
+ * @return FALSE if failed
+ */
+static bool zscale(double *s, size_t n, double contrast, imgstat *st){
+    size_t k = 0;
+    for(size_t i = 0; i < n; ++i) if(!isnan(s[i])) s[k++] = s[i];
+    n = k;
+    if(n < 2){
+        WARNX(_("Too few valid pixels for zscale"));
+        return FALSE;
+    }
+    qsort(s, n, sizeof(double), cmpdbl);
+    double zmin = s[0], zmax = s[n-1], sum = 0., sum2 = 0.;
+    for(size_t i = 0; i < n; ++i){ sum += s[i]; sum2 += s[i]*s[i]; }
+    st->mean = sum / n;
+    st->std = sqrt(fabs(sum2 / n - st->mean * st->mean));
+    size_t center = (n - 1) / 2;
+    st->median = (n & 1) ? s[center] : (s[center] + s[center+1]) / 2.;
+    uint8_t *flag = MALLOC(uint8_t, n);
+    double slope;
+    size_t ngood = zsc_fitline(s, n, flag, &slope);
+    FREE(flag);
+    st->min = zmin; st->max = zmax;
+    if(ngood >= MAX(ZSC_MINPIX, (size_t)(n * (1. - ZSC_MAXREJECT)))){
+        if(contrast > 0.) slope /= contrast;
+        st->min = MAX(zmin, st->median - center * slope);
+        st->max = MIN(zmax, st->median + (n - 1 - center) * slope);
+    }
+    return TRUE;
+}
+
+/**
+ * @brief image_zscale - calculate zscale display limits by sample of pixels
+ * @param img (i)   - image
+ * @param contrast  - contrast (<= 0 for default 0.25)
+ * @param nsamples  - amount of pixels in sample (0 for default 1000)
+ * @param st (o)    - output: min/max - limits (use them in normalize_dbl or mktransform),
+ *                    median, mean and std - of sample
+ * @return `st` or NULL if failed
+ */
+imgstat *image_zscale(const FITSimage *img, double contrast, size_t nsamples, imgstat *st){
+    if(!img || !img->data || img->totpix < 1 || img->naxis < 1 || !st) return NULL;
+    if(contrast <= 0.) contrast = ZSC_CONTRAST;
+    if(nsamples == 0) nsamples = ZSC_NSAMPLES;
+    // regular grid: equal steps along rows and columns, but not larger than the shorter axis
+    // (then step along the longer one gives `nsamples`; for 1-D image it's stride over pixels)
+    size_t W = img->naxes[0], H = img->totpix / W, sx = 1, sy = 1;
+    if((size_t)img->totpix > nsamples){
+        size_t step = (size_t)sqrt((double)img->totpix / nsamples);
+        if(step < 1) step = 1;
+        if(W < H){
+            sx = MIN(step, W);
+            sy = H * ((W + sx - 1) / sx) / nsamples;
+        }else{
+            sy = MIN(step, H);
+            sx = W * ((H + sy - 1) / sy) / nsamples;
+        }
+        sx = MIN(MAX(sx, 1), W);
+        sy = MIN(MAX(sy, 1), H);
+    }
+    size_t nx = (W + sx - 1) / sx, ny = (H + sy - 1) / sy;
+    double *s = MALLOC(double, nx * ny);
+    size_t n = 0;
+    for(size_t y = sy / 2; y < H; y += sy)
+        for(size_t x = sx / 2; x < W; x += sx) s[n++] = pixval(img, y * W + x);
+    bool ok = zscale(s, n, contrast, st);
+    FREE(s);
+    return ok ? st : NULL;
+}
+
+/**
+ * @brief dbl_zscale - calculate zscale display limits of double image (see image_zscale)
+ */
+imgstat *dbl_zscale(const doubleimage *im, double contrast, size_t nsamples, imgstat *st){
+    if(!im || !im->data || im->totpix < 1) return NULL;
+    long naxes[2] = {im->width, im->height};
+    FITSimage img = {.naxis = 2, .naxes = naxes, .totpix = im->totpix, .dtype = TDOUBLE, .data = im->data};
+    return image_zscale(&img, contrast, nsamples, st);
+}
+
+// pipeline needs histogram
+static bool need_histogram(const display_pars *p){
+    return p->histeq || p->fracbtm > 0. || p->fractop > 0.;
+}
+
+/**
+ * @brief get_sample - get sample of pixels (without NaNs)
+ * @param img (i) - image
+ * @param nmax    - max amount of pixels
+ * @param n (o)   - amount of pixels in sample
+ * @return array with sample (allocated here) or NULL
+ */
+static double *get_sample(const FITSimage *img, size_t nmax, size_t *n){
+    size_t totpix = img->totpix, N = MIN(nmax, totpix);
+    double *s = MALLOC(double, N);
+    if(N == totpix){
+        if(!image_pix2double(img, 0, N, s)){ FREE(s); return NULL; }
+    }else{ // chunks evenly spread over image
+        size_t nchunks = N / DISP_SAMPLECHUNK;
+        if(nchunks < 1) nchunks = 1;
+        N = 0;
+        for(size_t c = 0; c < nchunks; ++c){
+            size_t first = c * totpix / nchunks, l = MIN(DISP_SAMPLECHUNK, totpix - first);
+            if(!image_pix2double_block(img, first, l, &s[N])){ FREE(s); return NULL; }
+            N += l;
+        }
+    }
+    size_t k = 0;
+    for(size_t i = 0; i < N; ++i) if(!isnan(s[i])) s[k++] = s[i];
+    *n = k;
+    return s;
+}
+
+// extremal values of sample
+static void sample_minmax(const double *s, size_t n, double *min, double *max){
+    double mi = s[0], ma = s[0];
+    for(size_t i = 1; i < n; ++i){
+        if(s[i] < mi) mi = s[i];
+        if(s[i] > ma) ma = s[i];
+    }
+    *min = mi; *max = ma;
+}
+
+/**
+ * @brief mkluts - calculate limits and histogram LUTs by sample of pixels
+ * @param d (io)      - pipeline (limits stored in it)
+ * @param img (i)     - image
+ * @param eq, cut (o) - LUTs for equalization and cut-off (NULL if not used)
+ * @return FALSE if failed
+ */
+static bool mkluts(display *d, const FITSimage *img, histlut **eq, histlut **cut){
+    const display_pars *p = &d->p;
+    *eq = *cut = NULL;
+    double min = p->min, max = p->max;
+    if(!(max > min) && p->zscale){
+        imgstat st;
+        if(!image_zscale(img, p->contrast, 0, &st)) return FALSE;
+        min = st.min; max = st.max;
+        if(!need_histogram(p)){
+            d->min = min; d->max = max;
+            return TRUE;
+        }
+    }
+    size_t n;
+    double *s = get_sample(img, p->nsamples, &n);
+    if(!s) return FALSE;
+    if(n == 0){
+        WARNX(_("Image have no valid pixels"));
+        FREE(s);
+        return FALSE;
+    }
+    if(!(max > min)) sample_minmax(s, n, &min, &max);
+    if((max - min) < 2.*DBL_EPSILON){
+        WARNX(_("Data range is too small"));
+        FREE(s);
+        return FALSE;
+    }
+    d->min = min; d->max = max;
+    if(need_histogram(p)){ // histograms of normalized sample as in stage-by-stage conversion
+        doubleimage sample = {.width = n, .height = 1, .totpix = n, .data = s};
+        double scale = 1. / (max - min);
+        for(size_t i = 0; i < n; ++i){
+            double x = (s[i] - min) * scale;
+            x = (x >= 0.) ? x : 0.;
+            s[i] = (x <= 1.) ? x : 1.;
+        }
+        histogram *H = dbl2histogram(&sample, p->nlevls);
+        if(p->histeq){
+            *eq = hist2lut_equalize(H);
+            histogram_free(&H);
+            if(p->fracbtm > 0. || p->fractop > 0.){
+                dbl_applylut(&sample, *eq);
+                H = dbl2histogram(&sample, p->nlevls);
+            }
+        }
+        if(H){
+            *cut = hist2lut_cutoff(H, p->fracbtm, p->fractop);
+            histogram_free(&H);
+        }
+    }
+    FREE(s);
+    return TRUE;
+}
+
+/**
+ * @brief mktable - build RGBA table for given nodes
+ * @param d (io)      - pipeline
+ * @param nodes (io)  - normalized values of table entries (would be changed)
+ * @param eq, cut (i) - LUTs for equalization and cut-off (or NULL)
+ * @return FALSE if failed
+ */
+static bool mktable(display *d, doubleimage *nodes, const histlut *eq, const histlut *cut){
+    if(eq && !dbl_applylut(nodes, eq)) return FALSE;
+    if(cut && !dbl_applylut(nodes, cut)) return FALSE;
+    if(d->p.transf != TRANSF_LINEAR){
+        imgstat st = {.min = 0., .max = 1.};
+        for(size_t i = 0; i < nodes->totpix; ++i){ // transforms are defined on [0, 1]
+            double x = nodes->data[i];
+            x = (x >= 0.) ? x : 0.;
+            nodes->data[i] = (x <= 1.) ? x : 1.;
+        }
+        if(!mktransform_par(nodes, &st, d->p.transf, d->p.transfpar)) return FALSE;
+    }
+    FREE(d->lut);
+    d->lutsize = nodes->totpix;
+    d->lut = MALLOC(uint8_t, 4 * d->lutsize);
+    palette_convert(nodes->data, nodes->totpix, palette_table(d->p.cmap), d->lut, TRUE);
+    return TRUE;
+}
+
+// prepare table for image
+static bool prepare(display *d, const FITSimage *img){
+    const display_pars *p = &d->p;
+    histlut *eq = NULL, *cut = NULL;
+    if(p->max > p->min && !need_histogram(p)){
+        d->min = p->min; d->max = p->max;
+    }else if(!mkluts(d, img, &eq, &cut)) return FALSE;
+    // table of other types is indexed by normalized value, so it doesn't depend on limits
+    bool direct = (img->dtype == TBYTE || img->dtype == TUSHORT);
+    if(!eq && !cut && d->lut && d->lutdtype == img->dtype &&
+        (!direct || (d->lutmin == d->min && d->lutmax == d->max)))
+        return TRUE; // table is already built
+    d->lutmin = d->min; d->lutmax = d->max;
+    size_t N;
+    if(direct) N = (img->dtype == TBYTE) ? 1<<8 : 1<<16;
+    else N = DISP_LUTSIZE + 1;
+    doubleimage *nodes = doubleimage_new(N, 1);
+    double scale = 1. / (d->max - d->min);
+    for(size_t i = 0; i < N; ++i)
+        nodes->data[i] = direct ? (i - d->min) * scale : (double)i / DISP_LUTSIZE;
+    bool ret = mktable(d, nodes, eq, cut);
+    d->lutdtype = ret ? img->dtype : 0;
+    doubleimage_free(&nodes);
+    histlut_free(&eq);
+    histlut_free(&cut);
+    return ret;
+}
+
+// copy table entries into output
+static inline void put_pixels(const uint32_t *idx, size_t n, const uint8_t *lut, uint8_t *o, bool rgba){
+    if(rgba){
+        for(size_t i = 0; i < n; ++i) memcpy(&o[4*i], &lut[4*idx[i]], 4);
+    }else{ // write 4 bytes per pixel: 4th byte would be overwritten by next pixel
+        for(size_t i = 0; i + 1 < n; ++i) memcpy(&o[3*i], &lut[4*idx[i]], 4);
+        memcpy(&o[3*(n-1)], &lut[4*idx[n-1]], 3);
+    }
+}
+
+/**
+ * @brief display_render - convert image into colour for display
+ * @param d (i)   - pipeline
+ * @param img (i) - image (all its pixels are converted)
+ * @param out (o) - output buffer with 3 (RGB) or 4 (RGBA) bytes per pixel or NULL
+ * @return `out` or buffer allocated here if `out` is NULL; NULL if failed
+ */
+uint8_t *display_render(display *d, const FITSimage *img, uint8_t *out){
+    if(!d || !img || !img->data || img->totpix < 1) return NULL;
+#ifdef EBUG
+    double t0 = dtime();
+#endif
+    initomp();
+    if(!prepare(d, img)) return NULL;
+    bool rgba = d->p.rgba, direct = (img->dtype == TBYTE || img->dtype == TUSHORT), allocated = !out;
+    size_t totpix = img->totpix, bpp = rgba ? 4 : 3, nblocks = (totpix + DISP_BLKSZ - 1) / DISP_BLKSZ;
+    if(allocated) out = MALLOC(uint8_t, totpix * bpp);
+    const uint8_t *lut = d->lut;
+    double min = d->min, scale = DISP_LUTSIZE / (d->max - d->min), dn = (double)DISP_LUTSIZE;
+    bool good = TRUE;
+    OMP_FOR()
+    for(size_t b = 0; b < nblocks; ++b){
+        size_t first = b * DISP_BLKSZ, n = MIN(DISP_BLKSZ, totpix - first);
+        uint32_t idx[DISP_BLKSZ];
+        if(direct){
+            if(img->dtype == TBYTE){
+                const uint8_t *in = (const uint8_t*)img->data + first;
+                OMP_SIMD()
+                for(size_t i = 0; i < n; ++i) idx[i] = in[i];
+            }else{
+                const uint16_t *in = (const uint16_t*)img->data + first;
+                OMP_SIMD()
+                for(size_t i = 0; i < n; ++i) idx[i] = in[i];
+            }
+        }else{
+            double v[DISP_BLKSZ];
+            if(!image_pix2double_block(img, first, n, v)){
+                good = FALSE;
+                continue;
+            }
+            OMP_SIMD()
+            for(size_t i = 0; i < n; ++i){
+                double x = (v[i] - min) * scale + 0.5;
+                x = (x >= 0.) ? x : 0.;
+                x = (x <= dn) ? x : dn;
+                idx[i] = (uint32_t)x;
+            }
+        }
+        put_pixels(idx, n, lut, &out[first * bpp], rgba);
+    }
+    DBG("time for rendering of %zd pixels: %gs", totpix, dtime() - t0);
+    if(!good){
+        WARNX(_("Can't convert image"));
+        if(allocated) FREE(out);
+        return NULL;
+    }
+    return out;
+}
+
+/*
+ * RGB composite of three images (e.g. frames in different filters). Stretch of each
+ * channel is tabulated (by mktransform_par) into table indexed by normalized value,
+ * so composite is built in one parallel pass by blocks of pixels without full-size
+ * intermediate arrays.
+ * Lupton stretch (Lupton et al., 2004, PASP 116, 133) is applied to total intensity
+ * I = (R + G + B) / 3 of normalized channels: each channel is multiplied by
+ * asinh(Q*I) / (asinh(Q) * I), so colour of pixels is preserved; saturated pixels are
+ * scaled down by max of their channels (instead of clipping each channel).
+ */
+
+// prepare limits of channel
+static bool channel_limits(const FITSimage *img, const rgb_pars *p, int c, double *min, double *max){
+    double mi = p->min[c], ma = p->max[c];
+    if(!(ma > mi)){
+        if(p->zscale){
+            imgstat st;
+            if(!image_zscale(img, p->contrast, 0, &st)) return FALSE;
+            mi = st.min; ma = st.max;
+        }else{
+            size_t n;
+            double *s = get_sample(img, p->nsamples ? p->nsamples : DISP_NSAMPLES, &n);
+            if(!s) return FALSE;
+            if(n == 0){
+                WARNX(_("Image have no valid pixels"));
+                FREE(s);
+                return FALSE;
+            }
+            sample_minmax(s, n, &mi, &ma);
+            FREE(s);
+        }
+    }
+    if((ma - mi) < 2.*DBL_EPSILON){
+        WARNX(_("Data range is too small"));
+        return FALSE;
+    }
+    *min = mi; *max = ma;
+    return TRUE;
+}
+
+/**
+ * @brief mkstretch - tabulate stretch on DISP_LUTSIZE+1 nodes in [0, 1]
+ * @param p (i) - parameters
+ * @return table (allocated here) or NULL if failed:
+ *      RGBSTRETCH_CHANNEL - output value of channel (0..255 scaled to [0, 1]);
+ *      RGBSTRETCH_LUPTON  - multiplier of channels for given intensity
+ */
+static double *mkstretch(const rgb_pars *p){
+    doubleimage *nodes = doubleimage_new(DISP_LUTSIZE + 1, 1);
+    for(size_t i = 0; i <= DISP_LUTSIZE; ++i) nodes->data[i] = (double)i / DISP_LUTSIZE;
+    imgstat st = {.min = 0., .max = 1.};
+    if(p->stretch == RGBSTRETCH_LUPTON){
+        if(!mktransform_par(nodes, &st, TRANSF_ASINH, p->transfpar)){
+            doubleimage_free(&nodes);
+            return NULL;
+        }
+        double *t = nodes->data;
+        for(size_t i = 1; i <= DISP_LUTSIZE; ++i) t[i] /= (double)i / DISP_LUTSIZE;
+        t[0] = t[1]; // limit of asinh(Q*I)/I at zero
+    }else if(p->transf != TRANSF_WRONG && p->transf != TRANSF_LINEAR){
+        if(!mktransform_par(nodes, &st, p->transf, p->transfpar)){
+            doubleimage_free(&nodes);
+            return NULL;
+        }
+    }
+    double *t = nodes->data;
+    nodes->data = NULL;
+    doubleimage_free(&nodes);
+    return t;
+}
+
+/**
+ * @brief make_rgb_composite - make colour image from three images
+ * @param r, g, b (i) - images for red, green and blue channels (of the same size)
+ * @param pars (i)    - parameters of stretch
+ * @param out (o)     - output buffer with 3 bytes (RGB) per pixel or NULL
+ * @return `out` or buffer allocated here if `out` is NULL; NULL if failed
+ */
+uint8_t *make_rgb_composite(const FITSimage *r, const FITSimage *g, const FITSimage *b,
+                            const rgb_pars *pars, uint8_t *out){
+    const FITSimage *img[3] = {r, g, b};
+    if(!pars || pars->stretch <= RGBSTRETCH_WRONG || pars->stretch >= RGBSTRETCH_COUNT ||
+            pars->transf >= TRANSF_COUNT){
+        WARNX(_("Wrong parameters"));
+        return NULL;
+    }
+    for(int c = 0; c < 3; ++c){
+        if(!img[c] || !img[c]->data || img[c]->totpix < 1 || img[c]->naxis != r->naxis ||
+                img[c]->totpix != r->totpix || memcmp(img[c]->naxes, r->naxes, sizeof(long)*r->naxis)){
+            WARNX(_("Images should have the same size"));
+            return NULL;
+        }
+    }
+#ifdef EBUG
+    double t0 = dtime();
+#endif
+    initomp();
+    double min[3], scale[3], weight[3];
+    bool lupton = (pars->stretch == RGBSTRETCH_LUPTON);
+    for(int c = 0; c < 3; ++c){
+        double max;
+        if(!channel_limits(img[c], pars, c, &min[c], &max)) return NULL;
+        weight[c] = (pars->weight[c] > 0.) ? pars->weight[c] : 1.;
+        // Lupton: normalized and weighted value; else: index in table
+        scale[c] = lupton ? weight[c] / (max - min[c]) : DISP_LUTSIZE / (max - min[c]);
+    }
+    double *tab = mkstretch(pars);
+    if(!tab) return NULL;
+    uint8_t *ctab = NULL;
+    if(!lupton){ // channel values are quantized once
+        ctab = MALLOC(uint8_t, DISP_LUTSIZE + 1);
+        for(size_t i = 0; i <= DISP_LUTSIZE; ++i){
+            double x = tab[i] * 255. + 0.5;
+            x = (x >= 0.) ? x : 0.;
+            ctab[i] = (x <= 255.) ? (uint8_t)x : 255;
+        }
+    }
+    size_t totpix = r->totpix, nblocks = (totpix + DISP_BLKSZ - 1) / DISP_BLKSZ;
+    bool allocated = !out, good = TRUE;
+    if(allocated) out = MALLOC(uint8_t, totpix * 3);
+    double dn = (double)DISP_LUTSIZE;
+    OMP_FOR()
+    for(size_t blk = 0; blk < nblocks; ++blk){
+        size_t first = blk * DISP_BLKSZ, n = MIN(DISP_BLKSZ, totpix - first);
+        double v[3][DISP_BLKSZ];
+        uint8_t *o = &out[3 * first];
+        for(int c = 0; c < 3; ++c){
+            if(!image_pix2double_block(img[c], first, n, v[c])){
+                good = FALSE;
+                break;
+            }
+            double mi = min[c], sc = scale[c];
+            double *vc = v[c];
+            if(lupton){ // NaNs and values below limit have zero contribution
+                OMP_SIMD()
+                for(size_t i = 0; i < n; ++i){
+                    double x = (vc[i] - mi) * sc;
+                    vc[i] = (x >= 0.) ? x : 0.;
+                }
+            }else{
+                OMP_SIMD()
+                for(size_t i = 0; i < n; ++i){
+                    double x = (vc[i] - mi) * sc + 0.5;
+                    x = (x >= 0.) ? x : 0.;
+                    x = (x <= dn) ? x : dn;
+                    o[3*i + c] = ctab[(size_t)x];
+                }
+            }
+        }
+        if(!good || !lupton) continue;
+        for(size_t i = 0; i < n; ++i){
+            double R = v[0][i], G = v[1][i], B = v[2][i];
+            double I = (R + G + B) / 3. * dn + 0.5;
+            I = (I <= dn) ? I : dn; // I > 1 is saturated: table is constant there after scaling
+            double f = tab[(size_t)I];
+            R *= f; G *= f; B *= f;
+            double m = (R > G) ? R : G;
+            m = (m > B) ? m : B;
+            f = (m > 1.) ? 255. / m : 255.;
+            o[3*i]   = (uint8_t)(R * f + 0.5);
+            o[3*i+1] = (uint8_t)(G * f + 0.5);
+            o[3*i+2] = (uint8_t)(B * f + 0.5);
+        }
+    }
+    FREE(tab);
+    FREE(ctab);
+    DBG("time for RGB composite of %zd pixels: %gs", totpix, dtime() - t0);
+    if(!good){
+        WARNX(_("Can't convert image"));
+        if(allocated) FREE(out);
+        return NULL;
+    }
+    return out;
+}
+
+/**
+ * @brief dbl_rgb_composite - make colour image from three double images
+ *      (see make_rgb_composite)
+ */
+uint8_t *dbl_rgb_composite(const doubleimage *r, const doubleimage *g, const doubleimage *b,
+                           const rgb_pars *pars, uint8_t *out){
+    const doubleimage *im[3] = {r, g, b};
+    long naxes[3][2];
+    FITSimage img[3];
+    for(int c = 0; c < 3; ++c){
+        if(!im[c] || !im[c]->data) return NULL;
+        naxes[c][0] = im[c]->width; naxes[c][1] = im[c]->height;
+        img[c] = (FITSimage){.naxis = 2, .naxes = naxes[c], .totpix = im[c]->totpix,
+                             .dtype = TDOUBLE, .data = im[c]->data};
+    }
+    return make_rgb_composite(&img[0], &img[1], &img[2], pars, out);
+}
@@ -18,6 +18,8 @@
 
 #include "common.h"
 #include <gd.h>
+#include <string.h>
+#include <strings.h>
 
 /*
  * Read FITS image, convert it to double and save as JPEG
@@ -57,11 +59,11 @@ static myoption cmdlnopts[] = {
 // common options
     {"help",    NO_ARGS,    NULL,   'h',    arg_none,   APTR(&help),        _("show this help")},
     {"inname",  NEED_ARG,   NULL,   'i',    arg_string, APTR(&G.fitsname),  _("name of input file")},
-    {"outpname",NEED_ARG,   NULL,   'o',    arg_string, APTR(&G.outfile),   _("output file name (jpeg)")},
-    {"textline",NEED_ARG,   NULL,   't',    arg_string, APTR(&G.text),      _("add text line to output image (at bottom)")},
+    {"outpname",NEED_ARG,   NULL,   'o',    arg_string, APTR(&G.outfile),   _("output file name (jpeg; png or ppm by suffix)")},
+    {"textline",NEED_ARG,   NULL,   't',    arg_string, APTR(&G.text),      _("add text line to output image (at bottom, JPEG only)")},
     {"palette", NEED_ARG,   NULL,   'p',    arg_string, APTR(&G.palette),   _("convert as given palette (br, cold, gray, hot, jet)")},
     {"hdunumber",NEED_ARG,  NULL,   'n',    arg_int,    APTR(&G.nhdu),      _("open image from given HDU number")},
-    {"transform",NEED_ARG,  NULL,   'T',    arg_string, APTR(&G.transform), _("type of intensity transformation (exp, lin, log, pow, sqrt)")},
+    {"transform",NEED_ARG,  NULL,   'T',    arg_string, APTR(&G.transform), _("type of intensity transformation (asinh, exp, gamma, lin, log, pow, sinh, sqrt)")},
     {"rewrite", NO_ARGS,    NULL,   'r',    arg_none,   APTR(&G.rewrite),   _("rewrite output file")},
     {"histlvl", NEED_ARG,   NULL,   'l',    arg_int,    APTR(&G.nlvl),      _("amount of levels for histogram calculation")},
     {"hcutlow", NEED_ARG,   NULL,   'L',    arg_double, APTR(&G.histcutlow),_("histogram cut-off low limit")},
@@ -141,9 +143,15 @@ static bool write_jpeg(const char *fname, const uint8_t *data, const char *str,
 static intens_transform gettransf(const char *transf){
     if(!transf) return TRANSF_WRONG;
     switch(transf[0]){
+        case 'a': // asinh
+            return TRANSF_ASINH;
+        break;
         case 'e': // exp
             return TRANSF_EXP;
         break;
+        case 'g': // gamma
+            return TRANSF_GAMMA;
+        break;
         case 'l': // linear, log
         case 'L':
             switch(transf[1]){
@@ -162,15 +170,19 @@ static intens_transform gettransf(const char *transf){
         case 'p':
             return TRANSF_POW;
         break;
-        case 's':
+        case 's': // sqrt, sinh
+            if(transf[1] == 'i' || transf[1] == 'I') return TRANSF_SINH;
             return TRANSF_SQR;
         break;
     }
     fprintf(stderr, "Possible arguments of " COLOR_RED "\"Transformation\"" COLOR_OLD ":\n");
+    fprintf(stderr, "asinh - asinh transform (linear for faint and logariphmic for bright parts)\n");
     fprintf(stderr, "exp - exponential transform\n");
+    fprintf(stderr, "gamma - gamma correction x^(1/2.2)\n");
     fprintf(stderr, "linear (default) - linear transform (do nothing)\n");
     fprintf(stderr, "log - logariphmic transform\n");
     fprintf(stderr, "pow - x^2\n");
+    fprintf(stderr, "sinh - sinh transform\n");
     fprintf(stderr, "sqrt - sqrt(x)\n");
     return TRANSF_WRONG;
 }
@@ -270,15 +282,24 @@ int main(int argc, char *argv[]){
     green("Histogram before transformations:\n");
     histogram *h = dbl2histogram(dblimg, G.nlvl);
     print_histo(h);
-    histogram_free(&h);
+    histlut *L = NULL;
     if(G.histeq){ // equalize histogram
-        if(!dbl_histeq(dblimg, G.nlvl))
+        L = hist2lut_equalize(h);
+        if(!dbl_applylut(dblimg, L))
             ERRX(_("Can't do histogram equalization"));
+        histlut_free(&L);
     }
     if(G.histcutlow > DBL_EPSILON || G.histcuthigh > DBL_EPSILON){
-        if(!dbl_histcutoff(dblimg, G.nlvl, G.histcutlow, G.histcuthigh))
+        if(G.histeq){ // histogram was changed
+            histogram_free(&h);
+            h = dbl2histogram(dblimg, G.nlvl);
+        }
+        L = hist2lut_cutoff(h, G.histcutlow, G.histcuthigh);
+        if(!dbl_applylut(dblimg, L))
             ERRX(_("Can't make histogram cut-off"));
+        histlut_free(&L);
     }
+    histogram_free(&h);
     if(!mktransform(dblimg, st, tr)) ERRX(_("Can't do given transform"));
 #ifdef EBUG
     st = get_imgstat(dblimg, NULL);
@@ -289,8 +310,20 @@ int main(int argc, char *argv[]){
     print_histo(h);
     histogram_free(&h);
     uint8_t *colored = convert2palette(dblimg, colormap);
-    DBG("Save jpeg to %s", G.outfile);
-    if(!write_jpeg(G.outfile, colored, G.text, img)) ERRX(_("Can't save modified file %s"), G.outfile);
+    const char *suffix = strrchr(G.outfile, '.');
+    bool saved, jpeg = !suffix || (strcasecmp(suffix, ".png") && strcasecmp(suffix, ".ppm"));
+    if(G.text && !jpeg) WARNX(_("Text line is drawn only in JPEG output, ignore it"));
+    if(suffix && !strcasecmp(suffix, ".png")){
+        DBG("Save png to %s", G.outfile);
+        saved = write_png(G.outfile, colored, img->naxes[0], img->naxes[1], 3, 8);
+    }else if(suffix && !strcasecmp(suffix, ".ppm")){
+        DBG("Save ppm to %s", G.outfile);
+        saved = write_pnm(G.outfile, colored, img->naxes[0], img->naxes[1], 3, 8);
+    }else{
+        DBG("Save jpeg to %s", G.outfile);
+        saved = write_jpeg(G.outfile, colored, G.text, img);
+    }
+    if(!saved) ERRX(_("Can't save modified file %s"), G.outfile);
     green("File %s saved\n", G.outfile);
     return 0;
 }
@@ -156,12 +156,23 @@ returning:
     return fits;
 }
 
-static bool keylist_write(KeyList *kl, fitsfile *fp){
+// record is one of keywords of image statistics cache
+static bool is_statkey(const char *rec){
+    const char *keys[] = {"STATSUM ", "STATMEAN", "STATSTD ", "STATMED ", NULL};
+    for(int i = 0; keys[i]; ++i)
+        if(strncmp(rec, keys[i], 8) == 0) return TRUE;
+    return FALSE;
+}
+
+static bool keylist_write(KeyList *kl, fitsfile *fp, bool storestat){
     int st = 0;
     bool ret = TRUE;
     if(!fp || !kl) return FALSE;
     while(kl){
-        if(kl->keyclass > TYP_CMPRS_KEY){ // this record should be written
+        // checksums of old data are invalid: they're recalculated only with statistics;
+        // cached statistics without valid STATSUM could be taken for statistics of new data
+        bool skip = (kl->keyclass == TYP_CKSUM_KEY) || (!storestat && is_statkey(kl->record));
+        if(kl->keyclass > TYP_CMPRS_KEY && !skip){ // this record should be written
             fits_write_record(fp, kl->record, &st);
             DBG("Write %s, st = %d", kl->record, st);
             if(st){FITS_reporterr(&st); ret = FALSE;}
@@ -171,6 +182,31 @@ static bool keylist_write(KeyList *kl, fitsfile *fp){
     return ret;
 }
 
+/**
+ * @brief write_statsum - write checksums & set STATSUM equal to DATASUM of written data unit
+ * @param hdu - current HDU (its keylist will be modified too)
+ * @param fp  - file opened for writing
+ */
+static void write_statsum(FITSHDU *hdu, fitsfile *fp){
+    int st = 0;
+    char dsum[FLEN_VALUE], val[FLEN_VALUE+2];
+    fits_write_chksum(fp, &st);
+    fits_read_key(fp, TSTRING, "DATASUM", dsum, NULL, &st);
+    if(st){FITS_reporterr(&st); return;}
+    DBG("DATASUM: %s", dsum);
+    fits_update_key(fp, TSTRING, "STATSUM", dsum, NULL, &st);
+    // header was changed - recalculate CHECKSUM
+    fits_write_chksum(fp, &st);
+    if(st){FITS_reporterr(&st); return;}
+    snprintf(val, FLEN_VALUE+2, "'%s'", dsum);
+    keylist_modify_key(hdu->keylist, "STATSUM", val);
+    if(!keylist_modify_key(hdu->keylist, "DATASUM", val)){
+        char rec[2*FLEN_CARD];
+        snprintf(rec, 2*FLEN_CARD, "DATASUM = %s", val);
+        keylist_add_record(&hdu->keylist, rec, 1);
+    }
+}
+
 /**
  * @brief FITS_write - write FITS file to disk
  * @param filename   - new filename (with possible cfitsio additions like ! and so on)
@@ -189,6 +225,8 @@ bool FITS_write(char *filename, FITS *fits){
         FITSHDU *hdu = &fits->HDUs[i];
         if(!hdu) continue;
         FITSimage *img;
+        if(fits->storestat && hdu->hdutype == IMAGE_HDU && hdu->contents.image)
+            if(!image_stat_store(hdu, NULL)) WARNX(_("Can't store image statistics in header"));
         KeyList *records = hdu->keylist;
         DBG("HDU #%d (type %d)", i, hdu->hdutype);
         switch(hdu->hdutype){
@@ -198,14 +236,14 @@ bool FITS_write(char *filename, FITS *fits){
                     DBG("create empty image with records");
                     fits_create_img(fp, SHORT_IMG, 0, NULL, &fst);
                     if(fst){FITS_reporterr(&fst); continue;}
-                    keylist_write(records, fp);
+                    keylist_write(records, fp, fits->storestat);
                     DBG("OK");
                     continue;
                 }
                 DBG("create, bitpix: %d, naxis = %d, totpix = %ld", img->bitpix, img->naxis, img->totpix);
                 fits_create_img(fp, img->bitpix, img->naxis, img->naxes, &fst);
                 if(fst){FITS_reporterr(&fst); continue;}
-                keylist_write(records, fp);
+                keylist_write(records, fp, fits->storestat);
                 DBG("OK, now write image");
                 //int bscale = 1, bzero = 32768, status = 0;
                 //fits_set_bscale(fp, bscale, bzero, &status);
@@ -214,6 +252,7 @@ bool FITS_write(char *filename, FITS *fits){
                     fits_write_img(fp, img->dtype, 1, img->totpix, img->data, &fst);
                     DBG("status: %d", fst);
                     if(fst){FITS_reporterr(&fst); continue;}
+                    if(fits->storestat) write_statsum(hdu, fp);
                 }
             break;
             case BINARY_TBL:
@@ -377,6 +377,64 @@ doubleimage *image2double(FITSimage *img){
     return dblim;
 }
 
+// convert part of image data into double (in parallel if `parallel` is TRUE)
+static bool pix2double(const FITSimage *img, size_t first, size_t n, double *dst, bool parallel){
+    if(!img || !img->data || !dst || first + n > (size_t)img->totpix) return FALSE;
+    #define CONV(type)  do{const type *in = (const type*)img->data + first; \
+        if(parallel){OMP_FOR() for(size_t i = 0; i < n; ++i) dst[i] = (double)in[i];} \
+        else{OMP_SIMD() for(size_t i = 0; i < n; ++i) dst[i] = (double)in[i];}}while(0)
+    switch(img->dtype){
+        case TBYTE:
+            CONV(uint8_t);
+        break;
+        case TUSHORT:
+            CONV(uint16_t);
+        break;
+        case TUINT:
+            CONV(uint32_t);
+        break;
+        case TULONG:
+            CONV(uint64_t);
+        break;
+        case TFLOAT:
+            CONV(float);
+        break;
+        case TDOUBLE:
+            memcpy(dst, (const double*)img->data + first, n * sizeof(double));
+        break;
+        default:
+            WARNX(_("Undefined image type, cant convert to double"));
+            return FALSE;
+    }
+    #undef CONV
+    return TRUE;
+}
+
+/**
+ * @brief image_pix2double - convert part of image data into double (in parallel)
+ * @param img (i) - image
+ * @param first   - index of first pixel
+ * @param n       - amount of pixels
+ * @param dst (o) - output array (`n` elements)
+ * @return FALSE if failed
+ */
+bool image_pix2double(const FITSimage *img, size_t first, size_t n, double *dst){
+    return pix2double(img, first, n, dst, TRUE);
+}
+
+/**
+ * @brief image_pix2double_block - convert part of image data into double without starting
+ *      parallel region: for small blocks and for calls from parallel loops
+ * @param img (i) - image
+ * @param first   - index of first pixel
+ * @param n       - amount of pixels
+ * @param dst (o) - output array (`n` elements)
+ * @return FALSE if failed
+ */
+bool image_pix2double_block(const FITSimage *img, size_t first, size_t n, double *dst){
+    return pix2double(img, first, n, dst, FALSE);
+}
+
 /**
  * @brief get_imgstat - calculate simplest statistics: mean/std/min/max
  * @param dimg   - double array
@@ -391,6 +449,7 @@ imgstat *get_imgstat(const doubleimage *im, imgstat *est){
     size_t totpix = im->totpix;
     st.min = dimg[0];
     st.max = dimg[0];
+    st.median = NAN;
     double sum = dimg[0], sum2 = dimg[0];
     for(size_t i = 1; i < totpix; ++i){
         double val = dimg[i];
@@ -449,3 +508,125 @@ doubleimage *doubleimage_new(size_t w, size_t h){
     out->data = MALLOC(double, out->totpix);
     return out;
 }
+
+/*
+ * Image statistics cache in HDU headers:
+ * DATAMIN/DATAMAX, STATMEAN, STATSTD, STATMED and STATSUM - copy of DATASUM
+ * at the moment of statistics calculation. When STATSUM equal to DATASUM,
+ * the data unit wasn't changed, so statistics could be taken from header.
+ * FITS_write recalculates checksums only with `storestat` flag; without it neither old
+ * checksums nor cache keys (except DATAMIN/DATAMAX) are written.
+ */
+
+/**
+ * @brief image_fullstat - calculate statistics of image including median
+ * @param img (i) - image
+ * @param st  (o) - structure for output data (for thread-safe operations)
+ * @return `st` or internal static structure if `st` is NULL; NULL if failed
+ */
+imgstat *image_fullstat(FITSimage *img, imgstat *st){
+    static imgstat sst;
+    if(!img || !img->data || img->totpix < 1) return NULL;
+    if(!st) st = &sst;
+    doubleimage *dimg = image2double(img);
+    if(!dimg) return NULL;
+    get_imgstat(dimg, st);
+    st->median = dbl_select(dimg->data, dimg->totpix, (dimg->totpix - 1) / 2);
+    doubleimage_free(&dimg);
+    return st;
+}
+
+// change value of key `key` or add new record if it's absent
+static bool setkey(KeyList **list, char *key, char *val, char *comment){
+    if(keylist_modify_key(*list, key, val)) return TRUE;
+    char rec[2*FLEN_CARD];
+    snprintf(rec, 2*FLEN_CARD, "%s = %s / %s", key, val, comment);
+    if(keylist_add_record(list, rec, 1)) return TRUE;
+    return FALSE;
+}
+
+/**
+ * @brief image_stat_store - store image statistics in HDU keylist
+ *      STATSUM will be set to current DATASUM (or 0 if absent); FITS_write sets it to actual value
+ * @param hdu (io) - HDU with image
+ * @param st  (i)  - statistics (if NULL calculate here)
+ * @return TRUE if all OK
+ */
+bool image_stat_store(FITSHDU *hdu, imgstat *st){
+    if(!hdu || hdu->hdutype != IMAGE_HDU) return FALSE;
+    imgstat s;
+    if(!st){
+        st = image_fullstat(hdu->contents.image, &s);
+        if(!st) return FALSE;
+    }
+    char val[FLEN_VALUE];
+    struct{
+        char *key;
+        double val;
+        char *comment;
+    } keys[] = {
+        {"DATAMIN",  st->min,    "minimal pixel value"},
+        {"DATAMAX",  st->max,    "maximal pixel value"},
+        {"STATMEAN", st->mean,   "mean pixel value"},
+        {"STATSTD",  st->std,    "standard deviation of pixel values"},
+        {"STATMED",  st->median, "median pixel value"},
+        {NULL, 0., NULL}
+    };
+    for(int i = 0; keys[i].key; ++i){
+        if(isnan(keys[i].val)) continue;
+        snprintf(val, FLEN_VALUE, "%.15g", keys[i].val);
+        if(!setkey(&hdu->keylist, keys[i].key, val, keys[i].comment)) return FALSE;
+    }
+    char *dsum = keylist_find_keyval(hdu->keylist, "DATASUM", NULL);
+    snprintf(val, FLEN_VALUE, "'%s'", dsum ? dsum : "0");
+    FREE(dsum);
+    return setkey(&hdu->keylist, "STATSUM", val, "DATASUM for cached statistics");
+}
+
+// get double value of key `key` from list
+static bool getdblkey(KeyList *list, char *key, double *val){
+    char *v = keylist_find_keyval(list, key, NULL);
+    if(!v) return FALSE;
+    char *eptr;
+    *val = strtod(v, &eptr);
+    bool ret = (eptr != v);
+    FREE(v);
+    return ret;
+}
+
+/**
+ * @brief image_stat_cached - get image statistics from header (if valid) or calculate them
+ *      statistics in header are valid when STATSUM equal to DATASUM; in this case image pixels
+ *      aren't touched at all, so `hdu` may have no image data
+ *      BE CAREFUL: DATASUM is a value from file, so after changing of image data in memory
+ *      you should calculate statistics by image_fullstat
+ * @param hdu (i) - HDU with image
+ * @param st  (o) - structure for output data (for thread-safe operations)
+ * @return `st` or internal static structure if `st` is NULL; NULL if failed
+ */
+imgstat *image_stat_cached(FITSHDU *hdu, imgstat *st){
+    static imgstat sst;
+    if(!hdu || hdu->hdutype != IMAGE_HDU) return NULL;
+    if(!st) st = &sst;
+    char *ssum = keylist_find_keyval(hdu->keylist, "STATSUM", NULL);
+    char *dsum = keylist_find_keyval(hdu->keylist, "DATASUM", NULL);
+    bool valid = FALSE;
+    if(ssum && dsum){
+        char *e1, *e2;
+        unsigned long s = strtoul(ssum, &e1, 10), d = strtoul(dsum, &e2, 10);
+        if(e1 != ssum && e2 != dsum && s == d) valid = TRUE;
+        DBG("STATSUM=%lu, DATASUM=%lu", s, d);
+    }
+    FREE(ssum); FREE(dsum);
+    if(valid){
+        KeyList *l = hdu->keylist;
+        if(getdblkey(l, "DATAMIN", &st->min) && getdblkey(l, "DATAMAX", &st->max) &&
+           getdblkey(l, "STATMEAN", &st->mean) && getdblkey(l, "STATSTD", &st->std)){
+            if(!getdblkey(l, "STATMED", &st->median)) st->median = NAN;
+            DBG("Got statistics from header");
+            return st;
+        }
+    }
+    DBG("Calculate statistics");
+    return image_fullstat(hdu->contents.image, st);
+}
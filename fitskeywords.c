@@ -38,6 +38,241 @@
  *  - add HYSTORY?
  */
 
+/*
+ * Hash index of keywords: open addressing table in first record of list, it's built
+ * together with list (by keylist_add_record() or keylist_read()) and then maintained by
+ * them and by removing functions, so searching never modifies list. Each cell holds first
+ * record with given keyword (in order of list) and amount of such records (COMMENT,
+ * HISTORY etc can repeat).
+ */
+// minimal amount of cells in index
+#define KEYIDX_MINSIZE  (64)
+
+typedef struct{
+    KeyList *node;      // first record with this keyword (NULL - empty cell)
+    uint32_t hash;      // hash of keyword
+    uint32_t count;     // amount of records with this keyword
+} keyidx_cell;
+
+// memory block with records read by keylist_read() (nodes and their records)
+typedef struct keypool_{
+    struct keypool_ *next;
+    char *start, *end;  // range of addresses
+} keypool;
+
+struct keyindex_{
+    keyidx_cell *cells;
+    size_t size;        // amount of cells (power of 2)
+    size_t used;        // amount of non-empty (including deleted) cells
+    keypool *pools;     // memory blocks of records (they are freed with index)
+};
+typedef struct keyindex_ keyindex;
+
+// marker of deleted cell
+static KeyList keyidx_deleted;
+#define KEYIDX_DELETED  (&keyidx_deleted)
+
+/**
+ * @brief keyname_len - length of keyword name in record
+ * @param rec (i) - record
+ * @return length of name: up to 8 characters before space or '=' (for HIERARCH - all
+ *      text before '=' without trailing spaces)
+ */
+static size_t keyname_len(const char *rec){
+    size_t L = 0;
+    if(strncasecmp(rec, "HIERARCH ", 9) == 0){
+        const char *eq = strchr(rec, '=');
+        if(!eq) return 8;
+        L = eq - rec;
+        while(L > 8 && rec[L-1] == ' ') --L;
+        return L;
+    }
+    while(L < 8 && rec[L] && rec[L] != ' ' && rec[L] != '=') ++L;
+    return L;
+}
+
+// case-insensitive FNV-1a hash of keyword
+static uint32_t keyname_hash(const char *name, size_t L){
+    uint32_t h = 2166136261u;
+    for(size_t i = 0; i < L; ++i){
+        uint8_t c = (uint8_t)name[i];
+        if(c >= 'a' && c <= 'z') c -= 'a' - 'A';
+        h = (h ^ c) * 16777619u;
+    }
+    return h;
+}
+
+// find cell with given keyword or NULL
+static keyidx_cell *keyidx_lookup(keyindex *idx, const char *name, size_t L, uint32_t h){
+    size_t mask = idx->size - 1;
+    for(size_t i = h & mask; ; i = (i + 1) & mask){
+        keyidx_cell *c = &idx->cells[i];
+        if(!c->node) return NULL;
+        if(c->node == KEYIDX_DELETED || c->hash != h) continue;
+        const char *r = c->node->record;
+        if(keyname_len(r) == L && strncasecmp(r, name, L) == 0) return c;
+    }
+}
+
+// rehash index into `size` cells (deleted cells are dropped)
+static void keyidx_resize(keyindex *idx, size_t size){
+    keyidx_cell *old = idx->cells;
+    size_t oldsize = idx->size, mask = size - 1;
+    idx->cells = MALLOC(keyidx_cell, size);
+    idx->size = size;
+    idx->used = 0;
+    for(size_t j = 0; j < oldsize; ++j){
+        if(!old[j].node || old[j].node == KEYIDX_DELETED) continue;
+        size_t i = old[j].hash & mask;
+        while(idx->cells[i].node) i = (i + 1) & mask;
+        idx->cells[i] = old[j];
+        ++idx->used;
+    }
+    FREE(old);
+}
+
+// add record (appended to end of list) into index
+static void keyidx_insert(keyindex *idx, KeyList *node){
+    if(!node->record) return;
+    size_t L = keyname_len(node->record);
+    uint32_t h = keyname_hash(node->record, L);
+    keyidx_cell *c = keyidx_lookup(idx, node->record, L, h);
+    if(c){ // repeated keyword: first record is still the same
+        ++c->count;
+        return;
+    }
+    if(2 * (idx->used + 1) > idx->size) keyidx_resize(idx, 2 * idx->size);
+    size_t mask = idx->size - 1, i = h & mask;
+    while(idx->cells[i].node && idx->cells[i].node != KEYIDX_DELETED) i = (i + 1) & mask;
+    if(!idx->cells[i].node) ++idx->used;
+    idx->cells[i] = (keyidx_cell){.node = node, .hash = h, .count = 1};
+}
+
+// remove record from index (before removing it from list)
+static void keyidx_remove(keyindex *idx, KeyList *node){
+    if(!node->record) return;
+    size_t L = keyname_len(node->record);
+    keyidx_cell *c = keyidx_lookup(idx, node->record, L, keyname_hash(node->record, L));
+    if(!c) return;
+    if(--c->count == 0){
+        c->node = KEYIDX_DELETED;
+        return;
+    }
+    if(c->node != node) return;
+    // first record removed: next one with the same keyword is after it
+    for(KeyList *l = node->next; l; l = l->next){
+        if(l->record && keyname_len(l->record) == L && strncasecmp(l->record, node->record, L) == 0){
+            c->node = l;
+            return;
+        }
+    }
+}
+
+// build index of list
+static keyindex *keyidx_build(KeyList *list){
+    keyindex *idx = MALLOC(keyindex, 1);
+    idx->size = KEYIDX_MINSIZE;
+    idx->cells = MALLOC(keyidx_cell, idx->size);
+    for(; list; list = list->next) keyidx_insert(idx, list);
+    return idx;
+}
+
+static void keyidx_free(keyindex **idx){
+    if(!idx || !*idx) return;
+    keypool *p = (*idx)->pools;
+    while(p){
+        keypool *next = p->next;
+        FREE(p);
+        p = next;
+    }
+    FREE((*idx)->cells);
+    FREE(*idx);
+}
+
+// check if `ptr` is in memory pools of list
+static bool keypool_owns(const keyindex *idx, const void *ptr){
+    if(!idx) return FALSE;
+    for(const keypool *p = idx->pools; p; p = p->next)
+        if((uintptr_t)ptr >= (uintptr_t)p->start && (uintptr_t)ptr < (uintptr_t)p->end) return TRUE;
+    return FALSE;
+}
+
+// free record and its node (if they aren't in memory pool)
+static void keynode_free(keyindex *idx, KeyList *node){
+    if(!keypool_owns(idx, node->record)) FREE(node->record);
+    if(!keypool_owns(idx, node)) FREE(node);
+}
+
+/*
+ * Classification of keywords (as fits_get_keyclass()) by table: '#' in name means
+ * digit at this position (the rest of keyword isn't checked), other names should match
+ * exactly. Keywords not found in table are classified by fits_get_keyclass(). EXTNAME isn't
+ * in table: its class depends on value ('COMPRESSED_IMAGE' is TYP_CMPRS_KEY).
+ */
+typedef struct{
+    const char *name;
+    int keyclass;
+} keyclass_rule;
+
+// sorted by first letter
+static const keyclass_rule keyclass_rules[] = {
+    {"BITPIX", TYP_STRUC_KEY}, {"BLANK", TYP_NULL_KEY}, {"BLOCKED", TYP_STRUC_KEY},
+    {"BSCALE", TYP_SCAL_KEY}, {"BUNIT", TYP_UNIT_KEY}, {"BZERO", TYP_SCAL_KEY},
+    {"CD#", TYP_WCS_KEY}, {"CDELT#", TYP_WCS_KEY}, {"CHECKSUM", TYP_CKSUM_KEY},
+    {"CONTINUE", TYP_CONT_KEY}, {"CROTA#", TYP_WCS_KEY}, {"CRPIX#", TYP_WCS_KEY},
+    {"CRVAL#", TYP_WCS_KEY}, {"CTYPE#", TYP_WCS_KEY}, {"CUNIT#", TYP_WCS_KEY},
+    {"DATAMAX", TYP_RANG_KEY}, {"DATAMIN", TYP_RANG_KEY}, {"DATASUM", TYP_CKSUM_KEY},
+    {"END", TYP_STRUC_KEY}, {"EPOCH", TYP_REFSYS_KEY}, {"EQUINOX", TYP_REFSYS_KEY},
+    {"EXTEND", TYP_STRUC_KEY}, {"EXTLEVEL", TYP_HDUID_KEY}, {"EXTVER", TYP_HDUID_KEY},
+    {"GCOUNT", TYP_STRUC_KEY}, {"GROUPS", TYP_STRUC_KEY},
+    {"HISTORY", TYP_COMM_KEY},
+    {"INHERIT", TYP_STRUC_KEY},
+    {"LATPOLE", TYP_WCS_KEY}, {"LONPOLE", TYP_WCS_KEY},
+    {"NAXIS", TYP_STRUC_KEY}, {"NAXIS#", TYP_STRUC_KEY},
+    {"PCOUNT", TYP_STRUC_KEY},
+    {"SIMPLE", TYP_STRUC_KEY},
+    {"TBCOL#", TYP_STRUC_KEY}, {"TDIM#", TYP_DIM_KEY}, {"TDISP#", TYP_DISP_KEY},
+    {"TDMAX#", TYP_RANG_KEY}, {"TDMIN#", TYP_RANG_KEY}, {"TFIELDS", TYP_STRUC_KEY},
+    {"TFORM#", TYP_STRUC_KEY}, {"THEAP", TYP_STRUC_KEY}, {"TLMAX#", TYP_RANG_KEY},
+    {"TLMIN#", TYP_RANG_KEY}, {"TNULL#", TYP_NULL_KEY}, {"TSCAL#", TYP_SCAL_KEY},
+    {"TTYPE#", TYP_STRUC_KEY}, {"TUNIT#", TYP_UNIT_KEY}, {"TZERO#", TYP_SCAL_KEY},
+    {"XTENSION", TYP_STRUC_KEY},
+};
+#define KEYCLASS_NRULES (sizeof(keyclass_rules) / sizeof(keyclass_rules[0]))
+
+/**
+ * @brief keyclass - get class of keyword record
+ * @param card (i) - record
+ * @return class (TYP_xx_KEY)
+ */
+static int keyclass(char *card){
+    // rules for each first letter: [first[c], first[c+1])
+    static uint8_t first[27];
+    static bool got = FALSE;
+    if(!got){
+        size_t r = 0;
+        for(int c = 0; c < 27; ++c){
+            while(r < KEYCLASS_NRULES && keyclass_rules[r].name[0] < 'A' + c) ++r;
+            first[c] = (uint8_t)r;
+        }
+        got = TRUE;
+    }
+    int c = card[0] - 'A';
+    if(card[0] == ' ' || card[0] == 0) return TYP_COMM_KEY;
+    if(c >= 0 && c < 26){
+        for(size_t r = first[c]; r < first[c+1]; ++r){
+            const char *n = keyclass_rules[r].name;
+            size_t i = 1;
+            while(n[i] && n[i] != '#' && n[i] == card[i]) ++i;
+            if(n[i] == '#'){
+                if(card[i] >= '0' && card[i] <= '9') return keyclass_rules[r].keyclass;
+            }else if(!n[i] && (i == 8 || card[i] == ' ' || card[i] == 0 || card[i] == '='))
+                return keyclass_rules[r].keyclass;
+        }
+    }
+    return fits_get_keyclass(card);
+}
+
 /**
  * @brief keylist_get_end - find last element in list
  * @param list (i) - pointer to first element of list
@@ -81,38 +316,59 @@ KeyList *keylist_add_record(KeyList **list, char *rec, int check){
         WARNX(_("Can't copy data"));
         return NULL;
     }
-    node->keyclass = fits_get_keyclass(rec);
+    node->keyclass = keyclass(rec);
     if(list){
         if(*list){ // there was root node - search last
             last = keylist_get_end(*list);
             last->next = node; // insert pointer to new node into last element in list
             (*list)->last = node;
+            if((*list)->index) keyidx_insert((*list)->index, node);
         //  DBG("last node %s", (*list)->last->record);
-        }else *list = node;
+        }else{ // new list: create its index
+            node->index = keyidx_build(node);
+            *list = node;
+        }
     }
     return node;
 }
 
 /**
- * @brief keylist_find_key - find record with given key
+ * @brief keylist_find_key - find first record with given key (case insensitive)
+ *      list isn't modified, so it's safe to search in one list from different threads
  * @param list (i) - pointer to first list element
- * @param key (i)  - key to find
+ * @param key (i)  - key to find (full name)
  * @return record with given key or NULL
  */
 KeyList *keylist_find_key(KeyList *list, char *key){
     if(!list || !key) return NULL;
     size_t L = strlen(key);
-    //DBG("try to find %s", key);
+    while(L && key[L-1] == ' ') --L;
+    if(list->index){
+        keyidx_cell *c = keyidx_lookup(list->index, key, L, keyname_hash(key, L));
+        if(c) return c->node;
+    }else for(; list; list = list->next){ // list without index (e.g. made by hands)
+        const char *r = list->record;
+        if(r && keyname_len(r) == L && strncasecmp(r, key, L) == 0) return list;
+    }
+    DBG("key %s not found", key);
+    return NULL;
+}
+
+/**
+ * @brief keylist_find_prefix - find first record which key starts with given prefix
+ *      (case insensitive)
+ * @param list (i)   - pointer to first list element
+ * @param prefix (i) - beginning of key
+ * @return record found or NULL
+ */
+KeyList *keylist_find_prefix(KeyList *list, char *prefix){
+    if(!list || !prefix) return NULL;
+    size_t L = strlen(prefix);
     do{
-        if(list->record){
-            if(strncasecmp(list->record, key, L) == 0){ // key found
-                //DBG("found:\n%s", list->record);
-                return list;
-            }
-        }
+        if(list->record && strncasecmp(list->record, prefix, L) == 0) return list;
         list = list->next;
     }while(list);
-    DBG("key %s not found", key);
+    DBG("prefix %s not found", prefix);
     return NULL;
 }
 
@@ -222,7 +478,7 @@ KeyList *keylist_modify_key(KeyList *list, char *key, char *newval){
         return NULL;
     }
     DBG("new record:\n%s", buf);
-    FREE(rec->record);
+    if(!keypool_owns(list->index, rec->record)) FREE(rec->record);
     rec->record = strdup(buf);
     return rec;
 }
@@ -234,30 +490,30 @@ KeyList *keylist_modify_key(KeyList *list, char *key, char *newval){
  */
 void keylist_remove_key(KeyList **keylist, char *key){
     if(!keylist || !*keylist || !key) return;
-    size_t L = strlen(key);
-    KeyList *prev = NULL, *list = *keylist, *last = keylist_get_end(list);
-    do{
-        if(list->record){
-            if(strncmp(list->record, key, L) == 0){ // key found
-                if(prev){ // not first record
-                    prev->next = list->next;
-                }else{ // first or only record
-                    if(*keylist == last){
-                        *keylist = NULL; // the only record - erase it
-                    }else{ // first record - modyfy heading record
-                        *keylist = list->next;
-                        (*keylist)->last = last;
-                    }
-                }
-                DBG("remove record by key \"%s\":\n%s",key, list->record);
-                FREE(list->record);
-                FREE(list);
-                return;
-            }
+    KeyList *list = keylist_find_key(*keylist, key);
+    if(!list) return;
+    KeyList *root = *keylist, *prev = NULL, *last = keylist_get_end(root);
+    keyindex *idx = root->index;
+    if(list != root){
+        prev = root;
+        while(prev->next != list) prev = prev->next;
+    }
+    if(idx) keyidx_remove(idx, list);
+    if(prev){ // not first record
+        prev->next = list->next;
+        if(list == last) root->last = prev;
+    }else{ // first or only record
+        if(root == last){
+            *keylist = NULL; // the only record - erase it
+        }else{ // first record - modyfy heading record
+            *keylist = list->next;
+            (*keylist)->last = last;
+            (*keylist)->index = idx;
         }
-        prev = list;
-        list = list->next;
-    }while(list);
+    }
+    DBG("remove record by key \"%s\":\n%s",key, list->record);
+    keynode_free(idx, list);
+    if(!*keylist) keyidx_free(&idx);
 }
 
 /**
@@ -267,24 +523,29 @@ void keylist_remove_key(KeyList **keylist, char *key){
  */
 void keylist_remove_records(KeyList **keylist, char *sample){
     if(!keylist || !sample) return;
+    if(!*keylist) return;
     KeyList *prev = NULL, *list = *keylist, *last = keylist_get_end(list);
+    keyindex *idx = list->index;
     DBG("remove %s", sample);
     do{
         if(list->record){
             if(strstr(list->record, sample)){ // key found
+                if(idx) keyidx_remove(idx, list);
                 if(prev){
                     prev->next = list->next;
+                    if(list == last) (*keylist)->last = last = prev;
                 }else{
                     if(*keylist == last){
                         *keylist = NULL; // the only record - erase it
                     }else{ // first record - modyfy heading record
                         *keylist = list->next;
                         (*keylist)->last = last;
+                        (*keylist)->index = idx;
                     }
                 }
                 KeyList *tmp = list->next;
-                FREE(list->record);
-                FREE(list);
+                keynode_free(idx, list);
+                if(!*keylist) keyidx_free(&idx);
                 list = tmp;
                 continue;
             }
@@ -301,12 +562,13 @@ void keylist_remove_records(KeyList **keylist, char *sample){
 void keylist_free(KeyList **list){
     if(!list || !*list) return;
     KeyList *node = *list, *next;
+    keyindex *idx = node->index;
     do{
         next = node->next;
-        FREE(node->record);
-        free(node);
+        keynode_free(idx, node);
         node = next;
     }while(node);
+    keyidx_free(&idx);
     *list = NULL;
 }
 
@@ -345,38 +607,66 @@ void keylist_print(KeyList *list){
 
 /**
  * @brief keylist_read read all keys from current FITS file
- * This function read keys from current HDU, starting from current position
+ * This function read keys from current HDU: header is read by one call and its records
+ * are parsed into one memory block (with nodes of list), index of keywords is built at once
  * @param fits - opened structure
  * @return keylist read
  */
 KeyList *keylist_read(FITS *fits){
     if(!fits || !fits->fp || !fits->curHDU) return NULL;
-    int fst = 0, nkeys = -1, keypos = -1;
+    int fst = 0, nkeys = 0;
+    char *hdr = NULL;
     KeyList *list = fits->curHDU->keylist;
-    fits_get_hdrpos(fits->fp, &nkeys, &keypos, &fst);
-    DBG("nkeys=%d, keypos=%d, status=%d", nkeys, keypos, fst);
-    if(nkeys < 1){
-        WARNX(_("No keywords in given HDU"));
-        return NULL;
-    }
+#ifdef EBUG
+    double t0 = dtime();
+#endif
+    fits_hdr2str(fits->fp, 0, NULL, 0, &hdr, &nkeys, &fst);
     if(fst){
         FITS_reporterr(&fst);
         return NULL;
     }
-    DBG("Find %d keys, keypos=%d", nkeys, keypos);
-    for(int j = 1; j <= nkeys; ++j){
-        char card[FLEN_CARD];
-        fits_read_record(fits->fp, j, card, &fst);
-        if(fst) FITS_reporterr(&fst);
-        else{
-            KeyList *kl = keylist_add_record(&list, card, 0);
-            if(!kl){
-                /// "     "
-                WARNX(_("Can't add record to list"));
-            }else{
-                DBG("add key %d [class: %d]: \"%s\"", j, kl->keyclass, card);
-            }
-        }
+    // header is string of 80-character records, END isn't counted in `nkeys`
+    size_t ncards = MIN((size_t)MAX(nkeys, 0), strlen(hdr) / (FLEN_CARD - 1));
+    DBG("Find %zd keys", ncards);
+    if(ncards < 1){
+        WARNX(_("No keywords in given HDU"));
+        fits_free_memory(hdr, &fst);
+        return NULL;
+    }
+    // lengths of records without trailing spaces
+    uint8_t *len = MALLOC(uint8_t, ncards);
+    size_t textsz = 0;
+    for(size_t i = 0; i < ncards; ++i){
+        const char *card = hdr + i * (FLEN_CARD - 1);
+        size_t l = FLEN_CARD - 1;
+        while(l && card[l-1] == ' ') --l;
+        len[i] = (uint8_t)l;
+        textsz += l + 1;
+    }
+    size_t nodesz = ncards * sizeof(KeyList);
+    keypool *pool = (keypool*) MALLOC(char, sizeof(keypool) + nodesz + textsz);
+    KeyList *nodes = (KeyList*)(pool + 1);
+    char *text = (char*)nodes + nodesz;
+    pool->start = (char*)nodes;
+    pool->end = text + textsz;
+    for(size_t i = 0; i < ncards; ++i){
+        memcpy(text, hdr + i * (FLEN_CARD - 1), len[i]);
+        text[len[i]] = 0;
+        nodes[i].record = text;
+        nodes[i].keyclass = keyclass(text);
+        if(i + 1 < ncards) nodes[i].next = &nodes[i+1];
+        text += len[i] + 1;
     }
+    FREE(len);
+    fits_free_memory(hdr, &fst);
+    if(list){ // append to existing list
+        keylist_get_end(list)->next = nodes;
+        if(list->index) for(size_t i = 0; i < ncards; ++i) keyidx_insert(list->index, &nodes[i]);
+    }else list = nodes;
+    list->last = &nodes[ncards - 1];
+    if(!list->index) list->index = keyidx_build(list);
+    pool->next = list->index->pools;
+    list->index->pools = pool;
+    DBG("time for reading of %zd keys: %gs", ncards, dtime() - t0);
     return list;
 }
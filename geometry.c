@@ -0,0 +1,417 @@
+/*
+ * This file is part of the FITSmaniplib project.
+ * Copyright 2019  Edward V. Emelianov <edward.emelianoff@gmail.com>, <eddy@sao.ru>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "FITSmanip.h"
+#include "local.h"
+#include <omp.h>
+
+/**************************************************************************************
+ *                           Geometric transformations                                *
+ **************************************************************************************/
+/*
+ * Crop, flip, transpose, rotation by 90 degrees and binning of 2-dimensional images.
+ * FITSimage of any type is processed as is (without conversion to double): kernels are
+ * generated for pixel sizes of 1, 2, 4 and 8 bytes; doubleimage uses 8-byte kernels.
+ * Transposition is cache-oblivious: region is recursively divided by larger side until
+ * it fits L1 cache; stripes of rows are processed in parallel. Square images are
+ * transposed in place.
+ * Rotations are counterclockwise (axis Y of FITS image is directed upwards).
+ */
+
+// max amount of pixels in leaf of recursive transposition (should fit L1 with its copy)
+#define GEOM_TLEAF      (1024)
+// amount of rows in stripe processed by one thread
+#define GEOM_TSTRIPE    (64)
+// size of blocks for in-place transposition of square images
+#define GEOM_TBLK       (32)
+// rows are swapped by chunks of this size (bytes)
+#define GEOM_SWAPCHUNK  (4096)
+
+// generate kernels for pixel type `T` (`sfx` is suffix of function names)
+#define GEOM_FUNCS(T, sfx)                                                                  \
+static void flipx_ ## sfx(T *row, size_t w){                                                \
+    for(size_t i = 0, j = w - 1; i < w / 2; ++i, --j){                                      \
+        T t = row[i]; row[i] = row[j]; row[j] = t;                                          \
+    }                                                                                       \
+}                                                                                           \
+/* transpose rows [r0, r1) and columns [c0, c1) of `src` (w x h) into `dst` (h x w) */      \
+static void transpose_ ## sfx(const T *src, T *dst, size_t w, size_t h,                     \
+                              size_t r0, size_t r1, size_t c0, size_t c1){                  \
+    size_t nr = r1 - r0, nc = c1 - c0;                                                      \
+    if(nr * nc <= GEOM_TLEAF || (nr == 1 && nc == 1)){                                      \
+        for(size_t c = c0; c < c1; ++c){                                                    \
+            T *d = &dst[c * h];                                                             \
+            for(size_t r = r0; r < r1; ++r) d[r] = src[r * w + c];                          \
+        }                                                                                   \
+        return;                                                                             \
+    }                                                                                       \
+    if(nr >= nc){                                                                           \
+        size_t m = r0 + nr / 2;                                                             \
+        transpose_ ## sfx(src, dst, w, h, r0, m, c0, c1);                                   \
+        transpose_ ## sfx(src, dst, w, h, m, r1, c0, c1);                                   \
+    }else{                                                                                  \
+        size_t m = c0 + nc / 2;                                                             \
+        transpose_ ## sfx(src, dst, w, h, r0, r1, c0, m);                                   \
+        transpose_ ## sfx(src, dst, w, h, r0, r1, m, c1);                                   \
+    }                                                                                       \
+}                                                                                           \
+/* in-place transposition of square n x n image */                                          \
+static void transpose_sq_ ## sfx(T *a, size_t n){                                           \
+    size_t nb = (n + GEOM_TBLK - 1) / GEOM_TBLK;                                            \
+    OMP_FOR(schedule(dynamic))                                                              \
+    for(size_t bi = 0; bi < nb; ++bi){                                                      \
+        size_t r0 = bi * GEOM_TBLK, r1 = MIN(r0 + GEOM_TBLK, n);                            \
+        for(size_t bj = bi; bj < nb; ++bj){                                                 \
+            size_t c0 = bj * GEOM_TBLK, c1 = MIN(c0 + GEOM_TBLK, n);                        \
+            for(size_t r = r0; r < r1; ++r)                                                 \
+                for(size_t c = (bi == bj) ? r + 1 : c0; c < c1; ++c){                       \
+                    T t = a[r * n + c]; a[r * n + c] = a[c * n + r]; a[c * n + r] = t;      \
+                }                                                                           \
+        }                                                                                   \
+    }                                                                                       \
+}
+
+GEOM_FUNCS(uint8_t, u8)
+GEOM_FUNCS(uint16_t, u16)
+GEOM_FUNCS(uint32_t, u32)
+GEOM_FUNCS(uint64_t, u64)
+
+// flip image data (w x h pixels of `pxsz` bytes) in place
+static bool flip_data(void *data, size_t w, size_t h, int pxsz, bool flipx, bool flipy){
+    size_t rowsz = w * pxsz;
+    initomp();
+    if(flipx){
+        OMP_FOR()
+        for(size_t y = 0; y < h; ++y){
+            uint8_t *row = (uint8_t*)data + y * rowsz;
+            switch(pxsz){
+                case 1: flipx_u8((uint8_t*)row, w); break;
+                case 2: flipx_u16((uint16_t*)row, w); break;
+                case 4: flipx_u32((uint32_t*)row, w); break;
+                case 8: flipx_u64((uint64_t*)row, w); break;
+            }
+        }
+    }
+    if(flipy){ // swap rows
+        OMP_FOR()
+        for(size_t y = 0; y < h / 2; ++y){
+            uint8_t tmp[GEOM_SWAPCHUNK];
+            uint8_t *r1 = (uint8_t*)data + y * rowsz, *r2 = (uint8_t*)data + (h - 1 - y) * rowsz;
+            for(size_t x = 0; x < rowsz; x += GEOM_SWAPCHUNK){
+                size_t l = MIN(GEOM_SWAPCHUNK, rowsz - x);
+                memcpy(tmp, r1 + x, l);
+                memcpy(r1 + x, r2 + x, l);
+                memcpy(r2 + x, tmp, l);
+            }
+        }
+    }
+    return TRUE;
+}
+
+/**
+ * @brief transpose_data - transpose image data
+ * @param data (i) - data (w x h pixels of `pxsz` bytes)
+ * @param w, h     - image size
+ * @param pxsz     - pixel size
+ * @return transposed data: `data` itself for square image, else allocated here; NULL if failed
+ */
+static void *transpose_data(void *data, size_t w, size_t h, int pxsz){
+    if(pxsz != 1 && pxsz != 2 && pxsz != 4 && pxsz != 8){
+        WARNX(_("Wrong pixel size: %d"), pxsz);
+        return NULL;
+    }
+#ifdef EBUG
+    double t0 = dtime();
+#endif
+    initomp();
+    if(w == h){
+        switch(pxsz){
+            case 1: transpose_sq_u8(data, w); break;
+            case 2: transpose_sq_u16(data, w); break;
+            case 4: transpose_sq_u32(data, w); break;
+            case 8: transpose_sq_u64(data, w); break;
+        }
+        DBG("time for in-place transposition of %zdx%zd: %gs", w, h, dtime() - t0);
+        return data;
+    }
+    void *out = image_data_malloc(w * h, pxsz);
+    if(!out) return NULL;
+    size_t nstripes = (h + GEOM_TSTRIPE - 1) / GEOM_TSTRIPE;
+    OMP_FOR()
+    for(size_t s = 0; s < nstripes; ++s){
+        size_t r0 = s * GEOM_TSTRIPE, r1 = MIN(r0 + GEOM_TSTRIPE, h);
+        switch(pxsz){
+            case 1: transpose_u8(data, out, w, h, r0, r1, 0, w); break;
+            case 2: transpose_u16(data, out, w, h, r0, r1, 0, w); break;
+            case 4: transpose_u32(data, out, w, h, r0, r1, 0, w); break;
+            case 8: transpose_u64(data, out, w, h, r0, r1, 0, w); break;
+        }
+    }
+    DBG("time for transposition of %zdx%zd: %gs", w, h, dtime() - t0);
+    return out;
+}
+
+// check that image is 2-dimensional
+static bool check_2d(const FITSimage *img){
+    if(!img || !img->data || img->naxis != 2){
+        WARNX(_("Support only 2-dimensional images"));
+        return FALSE;
+    }
+    return TRUE;
+}
+
+// check region
+static bool check_region(const imregion *r, size_t w, size_t h){
+    if(!r || r->w < 1 || r->h < 1 || r->x0 + r->w > w || r->y0 + r->h > h){
+        WARNX(_("Region is out of image"));
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/**
+ * @brief image_crop - copy part of image
+ * @param img (i) - 2-dimensional image
+ * @param r (i)   - region
+ * @return new image of the same type or NULL if failed
+ */
+FITSimage *image_crop(const FITSimage *img, const imregion *r){
+    if(!check_2d(img) || !check_region(r, img->naxes[0], img->naxes[1])) return NULL;
+    long naxes[2] = {r->w, r->h};
+    FITSimage *out = image_new(2, naxes, img->bitpix);
+    if(!out) return NULL;
+    size_t pxsz = img->pxsz, rowsz = r->w * pxsz, W = img->naxes[0];
+    const uint8_t *in = (const uint8_t*)img->data + (r->y0 * W + r->x0) * pxsz;
+    for(size_t y = 0; y < r->h; ++y)
+        memcpy((uint8_t*)out->data + y * rowsz, in + y * W * pxsz, rowsz);
+    return out;
+}
+
+/**
+ * @brief dbl_crop - copy part of double image
+ * @param im (i) - image
+ * @param r (i)  - region
+ * @return new image or NULL if failed
+ */
+doubleimage *dbl_crop(const doubleimage *im, const imregion *r){
+    if(!im || !im->data || !check_region(r, im->width, im->height)) return NULL;
+    doubleimage *out = doubleimage_new(r->w, r->h);
+    for(size_t y = 0; y < r->h; ++y)
+        memcpy(&out->data[y * r->w], &im->data[(r->y0 + y) * im->width + r->x0], r->w * sizeof(double));
+    return out;
+}
+
+/**
+ * @brief image_flip - mirror image in place
+ * @param img (io) - 2-dimensional image
+ * @param flipx    - mirror columns (left <-> right)
+ * @param flipy    - mirror rows (top <-> bottom)
+ * @return `img` or NULL if failed
+ */
+FITSimage *image_flip(FITSimage *img, bool flipx, bool flipy){
+    if(!check_2d(img)) return NULL;
+    flip_data(img->data, img->naxes[0], img->naxes[1], img->pxsz, flipx, flipy);
+    return img;
+}
+
+/**
+ * @brief dbl_flip - mirror double image in place
+ * @param im (io) - image
+ * @param flipx   - mirror columns (left <-> right)
+ * @param flipy   - mirror rows (top <-> bottom)
+ * @return `im` or NULL if failed
+ */
+doubleimage *dbl_flip(doubleimage *im, bool flipx, bool flipy){
+    if(!im || !im->data) return NULL;
+    flip_data(im->data, im->width, im->height, sizeof(double), flipx, flipy);
+    return im;
+}
+
+/**
+ * @brief image_transpose - transpose image (in place for square images; for other data
+ *      array is replaced)
+ * @param img (io) - 2-dimensional image
+ * @return `img` or NULL if failed
+ */
+FITSimage *image_transpose(FITSimage *img){
+    if(!check_2d(img)) return NULL;
+    void *d = transpose_data(img->data, img->naxes[0], img->naxes[1], img->pxsz);
+    if(!d) return NULL;
+    if(d != img->data){
+        FREE(img->data);
+        img->data = d;
+    }
+    long t = img->naxes[0];
+    img->naxes[0] = img->naxes[1];
+    img->naxes[1] = t;
+    return img;
+}
+
+/**
+ * @brief dbl_transpose - transpose double image (in place for square images; for other
+ *      data array is replaced)
+ * @param im (io) - image
+ * @return `im` or NULL if failed
+ */
+doubleimage *dbl_transpose(doubleimage *im){
+    if(!im || !im->data) return NULL;
+    double *d = transpose_data(im->data, im->width, im->height, sizeof(double));
+    if(!d) return NULL;
+    if(d != im->data){
+        FREE(im->data);
+        im->data = d;
+    }
+    size_t t = im->width;
+    im->width = im->height;
+    im->height = t;
+    return im;
+}
+
+/**
+ * @brief image_rot90 - rotate image by 90 degrees counterclockwise `nquarters` times
+ *      (in place for square images and rotation by 180 degrees)
+ * @param img (io)  - 2-dimensional image
+ * @param nquarters - amount of quarters (negative for clockwise rotation)
+ * @return `img` or NULL if failed
+ */
+FITSimage *image_rot90(FITSimage *img, int nquarters){
+    if(!check_2d(img)) return NULL;
+    switch(((nquarters % 4) + 4) % 4){
+        case 1: // (x, y) -> (H-1-y, x)
+            if(!image_transpose(img)) return NULL;
+            return image_flip(img, TRUE, FALSE);
+        case 2:
+            return image_flip(img, TRUE, TRUE);
+        case 3: // (x, y) -> (y, W-1-x)
+            if(!image_transpose(img)) return NULL;
+            return image_flip(img, FALSE, TRUE);
+        default:
+            return img;
+    }
+}
+
+/**
+ * @brief dbl_rot90 - rotate double image by 90 degrees counterclockwise `nquarters` times
+ *      (in place for square images and rotation by 180 degrees)
+ * @param im (io)   - image
+ * @param nquarters - amount of quarters (negative for clockwise rotation)
+ * @return `im` or NULL if failed
+ */
+doubleimage *dbl_rot90(doubleimage *im, int nquarters){
+    if(!im || !im->data) return NULL;
+    switch(((nquarters % 4) + 4) % 4){
+        case 1:
+            if(!dbl_transpose(im)) return NULL;
+            return dbl_flip(im, TRUE, FALSE);
+        case 2:
+            return dbl_flip(im, TRUE, TRUE);
+        case 3:
+            if(!dbl_transpose(im)) return NULL;
+            return dbl_flip(im, FALSE, TRUE);
+        default:
+            return im;
+    }
+}
+
+/**
+ * @brief bin_rows - bin image given by FITSimage or doubleimage
+ * @param img (i)  - image (or NULL)
+ * @param dimg (i) - double image (if `img` is NULL)
+ * @param w, h     - image size
+ * @param bx, by   - size of bin
+ * @param mean     - TRUE for mean value of bin, FALSE for sum
+ * @return binned image or NULL if failed
+ */
+static doubleimage *bin_rows(const FITSimage *img, const doubleimage *dimg, size_t w, size_t h,
+                             size_t bx, size_t by, bool mean){
+    if(bx < 1 || by < 1 || bx > w || by > h){
+        WARNX(_("Wrong bin size"));
+        return NULL;
+    }
+    size_t ow = w / bx, oh = h / by, iw = ow * bx; // incomplete bins are dropped
+    doubleimage *out = doubleimage_new(ow, oh);
+    double scale = mean ? 1. / (bx * by) : 1.;
+    bool good = TRUE;
+#ifdef EBUG
+    double t0 = dtime();
+#endif
+    initomp();
+    // accumulator and converted row for each thread
+    double *tbuf = MALLOC(double, 2 * iw * omp_get_max_threads());
+    OMP_FOR()
+    for(size_t y = 0; y < oh; ++y){
+        double *acc = &tbuf[2 * iw * omp_get_thread_num()], *buf = acc + iw;
+        memset(acc, 0, iw * sizeof(double));
+        for(size_t k = 0; k < by; ++k){ // sum rows of bin
+            size_t yi = y * by + k;
+            const double *row;
+            if(img){
+                if(!image_pix2double_block(img, yi * w, iw, buf)){
+                    good = FALSE;
+                    break;
+                }
+                row = buf;
+            }else row = &dimg->data[yi * w];
+            OMP_SIMD()
+            for(size_t x = 0; x < iw; ++x) acc[x] += row[x];
+        }
+        double *o = &out->data[y * ow];
+        if(bx == 1){
+            OMP_SIMD()
+            for(size_t x = 0; x < ow; ++x) o[x] = acc[x] * scale;
+        }else if(bx == 2){
+            OMP_SIMD()
+            for(size_t x = 0; x < ow; ++x) o[x] = (acc[2*x] + acc[2*x+1]) * scale;
+        }else{
+            for(size_t x = 0; x < ow; ++x){
+                const double *a = &acc[x * bx];
+                double s = 0.;
+                for(size_t j = 0; j < bx; ++j) s += a[j];
+                o[x] = s * scale;
+            }
+        }
+    }
+    FREE(tbuf);
+    DBG("time for binning %zdx%zd by %zdx%zd: %gs", w, h, bx, by, dtime() - t0);
+    if(!good) doubleimage_free(&out);
+    return out;
+}
+
+/**
+ * @brief image_bin - bin image of any type (incomplete bins at right and top are dropped)
+ * @param img (i) - 2-dimensional image
+ * @param bx, by  - size of bin along X and Y
+ * @param mean    - TRUE for mean value of bin, FALSE for sum
+ * @return binned image or NULL if failed
+ */
+doubleimage *image_bin(const FITSimage *img, size_t bx, size_t by, bool mean){
+    if(!check_2d(img)) return NULL;
+    return bin_rows(img, NULL, img->naxes[0], img->naxes[1], bx, by, mean);
+}
+
+/**
+ * @brief dbl_bin - bin double image (incomplete bins at right and top are dropped)
+ * @param im (i)  - image
+ * @param bx, by  - size of bin along X and Y
+ * @param mean    - TRUE for mean value of bin, FALSE for sum
+ * @return binned image or NULL if failed
+ */
+doubleimage *dbl_bin(const doubleimage *im, size_t bx, size_t by, bool mean){
+    if(!im || !im->data) return NULL;
+    return bin_rows(NULL, im, im->width, im->height, bx, by, mean);
+}
@@ -18,6 +18,7 @@
 
 #include "FITSmanip.h"
 #include "local.h"
+#include <omp.h>
 
 /**************************************************************************************
  *                              Histogram routines                                    *
@@ -30,58 +31,499 @@ void histogram_free(histogram **H){
     FREE(*H);
 }
 
+// amount of pixels in block (bin indexes are calculated for whole block at once)
+#define HIST_BLKSZ      (256)
+// amount of interleaved sub-histograms in each thread (power of 2): successive pixels increment
+// different counters, so there's no dependence between increments of the same (hot) bin
+#define HIST_NSUB       (4)
+// max amount of levels for using sub-histograms (all of them should fit L2 cache)
+#define HIST_SUBMAX     (1<<12)
+// memory budget for private histograms of threads
+#define HIST_MEMBUDGET  (1<<28)
+
+// private histograms of threads
+typedef struct{
+    size_t *data;       // nthreads*nsub histograms
+    size_t nvalues;     // amount of levels
+    size_t nsub;        // amount of sub-histograms for each thread
+    size_t hsz;         // size of all histograms of one thread
+    size_t nthreads;    // amount of threads
+    size_t nblocks;     // amount of blocks of pixels
+} privhist;
+
+// allocate private histograms for image with `totpix` pixels
+static void privhist_init(privhist *p, size_t nvalues, size_t totpix){
+    p->nvalues = nvalues;
+    p->nsub = (nvalues <= HIST_SUBMAX) ? HIST_NSUB : 1;
+    p->hsz = p->nsub * nvalues;
+    p->nblocks = (totpix + HIST_BLKSZ - 1) / HIST_BLKSZ;
+    size_t nthreads = omp_get_max_threads(), maxthreads = HIST_MEMBUDGET / (p->hsz * sizeof(size_t));
+    if(nthreads > maxthreads) nthreads = maxthreads;
+    if(nthreads > p->nblocks) nthreads = p->nblocks;
+    if(nthreads < 1) nthreads = 1;
+    p->nthreads = nthreads;
+    p->data = MALLOC(size_t, nthreads * p->hsz);
+}
+
+// merge private histograms into `histo` and free them
+static void privhist_merge(privhist *p, size_t *histo){
+    size_t nhist = p->nthreads * p->nsub, nvalues = p->nvalues;
+    OMP_FOR()
+    for(size_t v = 0; v < nvalues; ++v){
+        size_t s = 0;
+        for(size_t i = 0; i < nhist; ++i) s += p->data[i * nvalues + v];
+        histo[v] = s;
+    }
+    FREE(p->data);
+}
+
+// allocate histogram with `nvalues` uniform levels in [0, 1]
+static histogram *histogram_new(size_t nvalues, size_t totpix){
+    histogram *H = MALLOC(histogram, 1);
+    H->data = MALLOC(size_t, nvalues);
+    H->levels = MALLOC(double, nvalues+1); // have greatest value -> its size larger
+    H->size = nvalues;
+    H->totpix = totpix;
+    H->uniform = TRUE;
+    for(size_t i = 0; i <= nvalues; ++i)
+        H->levels[i] = ((double)i) / ((double)nvalues);
+    return H;
+}
+
 /**
  * @brief dbl2histogram - calculate histogram of normalized image `im`
+ * Each thread fills its private histograms, then they are merged
  * @param im (i)  - input image
- * @param nvalues - amount of levels (more than 2, less than 65536)
+ * @param nvalues - amount of levels (more than 2)
  * @return array with image histogram (allocated here)
  */
 histogram *dbl2histogram(doubleimage *im, size_t nvalues){
     if(!im || !im->data || nvalues < 2 || im->totpix < 1) return NULL;
-    if(nvalues > 65535){
-        WARNX(_("Amount of histogram levels should be less than 65536!"));
+#ifdef EBUG
+    double t0 = dtime();
+#endif
+    initomp();
+    histogram *H = histogram_new(nvalues, im->totpix);
+    privhist p;
+    privhist_init(&p, nvalues, im->totpix);
+    size_t nsub = p.nsub;
+    double top = (double)(nvalues - 1);
+    OMP_FOR(num_threads(p.nthreads))
+    for(size_t b = 0; b < p.nblocks; ++b){
+        size_t *h = &p.data[omp_get_thread_num() * p.hsz], idx[HIST_BLKSZ];
+        size_t start = b * HIST_BLKSZ, n = MIN(HIST_BLKSZ, im->totpix - start);
+        const double *d = &im->data[start];
+        OMP_SIMD()
+        for(size_t i = 0; i < n; ++i){
+            double v = d[i] * nvalues;
+            v = (v >= 0.) ? v : 0.; // NaNs are counted as zeros
+            v = (v < top) ? v : top;
+            idx[i] = (size_t)v + (i & (nsub - 1)) * nvalues;
+        }
+        for(size_t i = 0; i < n; ++i) ++h[idx[i]];
+    }
+    privhist_merge(&p, H->data);
+    DBG("time for histogram with %zd levels (%zd threads): %gs", nvalues, p.nthreads, dtime() - t0);
+    return H;
+}
+
+/**
+ * @brief int2histogram - calculate histogram of integer image (TBYTE or TUSHORT) with bin for
+ *      each possible value (so levels are value/256 or value/65536)
+ * @param img (i) - input image
+ * @return histogram (allocated here) or NULL if image have other type
+ */
+histogram *int2histogram(const FITSimage *img){
+    if(!img || !img->data || img->totpix < 1) return NULL;
+    size_t nvalues, totpix = img->totpix;
+    switch(img->dtype){
+        case TBYTE:
+            nvalues = 1<<8;
+        break;
+        case TUSHORT:
+            nvalues = 1<<16;
+        break;
+        default:
+            WARNX(_("Integer histogram can be built only for 8- and 16-bit images"));
+            return NULL;
+    }
+    initomp();
+    histogram *H = histogram_new(nvalues, totpix);
+    privhist p;
+    privhist_init(&p, nvalues, totpix);
+    size_t nsub = p.nsub;
+    OMP_FOR(num_threads(p.nthreads))
+    for(size_t b = 0; b < p.nblocks; ++b){
+        size_t *h = &p.data[omp_get_thread_num() * p.hsz];
+        size_t start = b * HIST_BLKSZ, end = MIN(start + HIST_BLKSZ, totpix);
+        if(img->dtype == TBYTE){
+            const uint8_t *d = (const uint8_t*)img->data;
+            for(size_t i = start; i < end; ++i) ++h[d[i] + (i & (nsub - 1)) * nvalues];
+        }else{
+            const uint16_t *d = (const uint16_t*)img->data;
+            for(size_t i = start; i < end; ++i) ++h[d[i] + (i & (nsub - 1)) * nvalues];
+        }
+    }
+    privhist_merge(&p, H->data);
+    return H;
+}
+
+/*
+ * Histograms of 32- and 64-bit data are built by keys: unsigned integers with the same order as
+ * pixel values (for floating point values bits of positive numbers are inverted by sign bit
+ * and all bits of negative numbers are inverted). First pass builds histogram of 16 most
+ * significant bits of keys and finds min/max; if data occupies less than HIST_MAXBINS/2 bins
+ * of it, second pass builds histogram with more bits of keys. So for integer data bins have
+ * width of power of 2 and for floating point data they are (almost) logarithmic.
+ */
+// max amount of bins for histograms by keys
+#define HIST_KEYBITS    (16)
+#define HIST_MAXBINS    (1<<HIST_KEYBITS)
+
+// key of pixel `i`
+static inline uint64_t pixkey(const void *data, int dtype, size_t i){
+    switch(dtype){
+        case TUINT:
+            return (uint64_t)((const uint32_t*)data)[i] << 32;
+        case TFLOAT:{
+            uint32_t u;
+            memcpy(&u, &((const float*)data)[i], sizeof(u));
+            u ^= (u >> 31) ? 0xFFFFFFFFu : 0x80000000u;
+            return (uint64_t)u << 32;
+        }
+        case TDOUBLE:{
+            uint64_t u;
+            memcpy(&u, &((const double*)data)[i], sizeof(u));
+            return u ^ ((u >> 63) ? UINT64_MAX : (UINT64_C(1) << 63));
+        }
+        default: // TULONG
+            return ((const uint64_t*)data)[i];
+    }
+}
+
+// value by key
+static double key2val(uint64_t k, int dtype){
+    switch(dtype){
+        case TUINT:
+            return (double)(uint32_t)(k >> 32);
+        case TFLOAT:{
+            uint32_t u = (uint32_t)(k >> 32);
+            u ^= (u >> 31) ? 0x80000000u : 0xFFFFFFFFu;
+            float f;
+            memcpy(&f, &u, sizeof(f));
+            return (double)f;
+        }
+        case TDOUBLE:{
+            uint64_t u = k ^ ((k >> 63) ? (UINT64_C(1) << 63) : UINT64_MAX);
+            double d;
+            memcpy(&d, &u, sizeof(d));
+            return d;
+        }
+        default:
+            return (double)k;
+    }
+}
+
+// is pixel `i` NaN?
+static inline bool pixnan(const void *data, int dtype, size_t i){
+    if(dtype == TFLOAT) return isnan(((const float*)data)[i]);
+    if(dtype == TDOUBLE) return isnan(((const double*)data)[i]);
+    return FALSE;
+}
+
+/**
+ * @brief key_histogram - histogram of 32- or 64-bit image by keys
+ * @param img (i) - image
+ * @param min, max (o) - min and max values
+ * @return histogram or NULL if there's no valid pixels
+ */
+static histogram *key_histogram(const FITSimage *img, double *min, double *max){
+    size_t totpix = img->totpix, nnan = 0;
+    const void *data = img->data;
+    int dtype = img->dtype;
+    uint64_t kmin = UINT64_MAX, kmax = 0;
+    int shift = 64 - HIST_KEYBITS;
+    privhist p;
+    privhist_init(&p, HIST_MAXBINS, totpix);
+    OMP_FOR(num_threads(p.nthreads) reduction(min:kmin) reduction(max:kmax) reduction(+:nnan))
+    for(size_t b = 0; b < p.nblocks; ++b){
+        size_t *h = &p.data[omp_get_thread_num() * p.hsz];
+        size_t start = b * HIST_BLKSZ, end = MIN(start + HIST_BLKSZ, totpix);
+        for(size_t i = start; i < end; ++i){
+            if(pixnan(data, dtype, i)){ ++nnan; continue; }
+            uint64_t k = pixkey(data, dtype, i);
+            if(k < kmin) kmin = k;
+            if(k > kmax) kmax = k;
+            ++h[k >> shift];
+        }
+    }
+    if(nnan == totpix){
+        FREE(p.data);
+        WARNX(_("All pixels are NaN"));
         return NULL;
     }
+    // find amount of bits for final histogram (32-bit keys have zero low bits)
+    int s = shift, smin = (dtype == TUINT || dtype == TFLOAT) ? 32 : 0;
+    while(s > smin && (kmax >> (s - 1)) - (kmin >> (s - 1)) < HIST_MAXBINS) --s;
+    uint64_t base = kmin >> s;
+    size_t nbins = (size_t)((kmax >> s) - base + 1);
     histogram *H = MALLOC(histogram, 1);
-    size_t *histo = MALLOC(size_t, nvalues);
-    double *lvls = MALLOC(double, nvalues+1); // have greatest value -> its size larger
-    H->data = histo;
-    H->levels = lvls;
-    H->size = nvalues;
+    H->data = MALLOC(size_t, nbins);
+    H->levels = MALLOC(double, nbins + 1);
+    H->size = nbins;
+    H->totpix = totpix - nnan;
+    if(s == shift){ // first pass is enough
+        size_t *all = MALLOC(size_t, HIST_MAXBINS);
+        privhist_merge(&p, all);
+        memcpy(H->data, &all[base], nbins * sizeof(size_t));
+        FREE(all);
+    }else{
+        FREE(p.data);
+        privhist_init(&p, nbins, totpix);
+        OMP_FOR(num_threads(p.nthreads))
+        for(size_t b = 0; b < p.nblocks; ++b){
+            size_t *h = &p.data[omp_get_thread_num() * p.hsz];
+            size_t start = b * HIST_BLKSZ, end = MIN(start + HIST_BLKSZ, totpix);
+            for(size_t i = start; i < end; ++i){
+                if(pixnan(data, dtype, i)) continue;
+                ++h[(pixkey(data, dtype, i) >> s) - base];
+            }
+        }
+        privhist_merge(&p, H->data);
+    }
+    *min = key2val(kmin, dtype);
+    *max = key2val(kmax, dtype);
+    // levels are values of lower boundaries of bins
+    for(size_t i = 0; i < nbins; ++i) H->levels[i] = key2val((base + i) << s, dtype);
+    H->levels[0] = *min;
+    H->levels[nbins] = *max;
+    return H;
+}
+
+/**
+ * @brief image_histogram - calculate histogram of image data without conversion to double
+ *      8- and 16-bit images have bin for each value, 32- and 64-bit integer images have bins
+ *      with width of power of 2, floating point images - almost logarithmic bins (see above);
+ *      NaNs are ignored
+ * @param img (i) - image
+ * @param min (o) - minimal value (or NULL)
+ * @param max (o) - maximal value (or NULL)
+ * @return histogram with levels in data units (allocated here) or NULL if failed
+ */
+histogram *image_histogram(const FITSimage *img, double *min, double *max){
+    if(!img || !img->data || img->totpix < 1) return NULL;
+#ifdef EBUG
+    double t0 = dtime();
+#endif
+    double mn, mx;
+    histogram *H = NULL;
+    initomp();
+    switch(img->dtype){
+        case TBYTE:
+        case TUSHORT:
+            H = int2histogram(img);
+            if(!H) return NULL;
+            for(size_t i = 0; i <= H->size; ++i) H->levels[i] = (double)i;
+            H->uniform = FALSE;
+            size_t lo = 0, hi = H->size - 1;
+            while(!H->data[lo]) ++lo;
+            while(!H->data[hi]) --hi;
+            mn = lo; mx = hi;
+        break;
+        case TUINT:
+        case TULONG:
+        case TFLOAT:
+        case TDOUBLE:
+            H = key_histogram(img, &mn, &mx);
+            if(!H) return NULL;
+        break;
+        default:
+            WARNX(_("Undefined image type"));
+            return NULL;
+    }
+    if(min) *min = mn;
+    if(max) *max = mx;
+    DBG("time for histogram (%zd bins) of image: %gs", H->size, dtime() - t0);
+    return H;
+}
+
+/*
+ * Histograms with non-uniform levels. Bin of value is found by branchless binary search
+ * over edges padded by +inf to length of power of 2: all pixels of block make the same
+ * steps, so each step is a vectorized loop over block. Values above the last edge (including
+ * +inf, which isn't less than padding) go to the last bin; values below the first edge and NaNs
+ * go to the first bin (like NaNs in histograms with uniform levels).
+ */
+// edges prepared for search
+typedef struct{
+    double *E;          // first `nbins` edges and +inf after them
+    size_t P;           // length of E (power of 2)
+    size_t nbins;       // amount of bins
+} edgesearch;
+
+// prepare edges for search; return FALSE if they aren't ascending
+static bool edgesearch_init(edgesearch *s, const double *edges, size_t nbins){
+    for(size_t i = 0; i < nbins; ++i)
+        if(!(edges[i] < edges[i+1])){
+            WARNX(_("Edges of bins should be strictly ascending"));
+            return FALSE;
+        }
+    size_t P = 1;
+    while(P < nbins) P <<= 1;
+    s->E = MALLOC(double, P);
+    for(size_t i = 0; i < P; ++i) s->E[i] = (i < nbins) ? edges[i] : INFINITY;
+    s->P = P;
+    s->nbins = nbins;
+    return TRUE;
+}
+
+// find bins for `n` values `d`: idx[i] is the last bin with lower edge <= d[i] (0 if none
+// or d[i] is NaN), but not more than nbins-1
+static void edgesearch_block(const edgesearch *s, const double *d, size_t n, size_t *idx){
+    const double *E = s->E;
+    size_t top = s->nbins - 1;
+    for(size_t i = 0; i < n; ++i) idx[i] = 0;
+    for(size_t step = s->P / 2; step; step >>= 1){
+        OMP_SIMD()
+        for(size_t i = 0; i < n; ++i){
+            size_t p = idx[i] + step;
+            idx[i] = (E[p] <= d[i]) ? p : idx[i];
+        }
+    }
+    OMP_SIMD()
+    for(size_t i = 0; i < n; ++i) idx[i] = (idx[i] < top) ? idx[i] : top;
+}
+
+/**
+ * @brief hist_mkedges - make edges of histogram bins
+ * @param type     - spacing of edges
+ * @param nbins    - amount of bins
+ * @param min, max - range of histogram
+ * @param scale    - for HIST_ASINH: values much less than `scale` have linear spacing, much
+ *      greater - logarithmic
+ * @return array of `nbins + 1` edges (allocated here) or NULL if failed
+ */
+double *hist_mkedges(hist_binning type, size_t nbins, double min, double max, double scale){
+    if(nbins < 1 || !(max > min)){
+        WARNX(_("Wrong parameters"));
+        return NULL;
+    }
+    double *edges = MALLOC(double, nbins + 1);
+    switch(type){
+        case HIST_UNIFORM:
+            for(size_t i = 0; i <= nbins; ++i) edges[i] = min + (max - min) * i / nbins;
+        break;
+        case HIST_LOG:
+            if(min <= 0.){
+                WARNX(_("Logarithmic bins need positive range"));
+                FREE(edges);
+                return NULL;
+            }
+            for(size_t i = 0; i <= nbins; ++i) edges[i] = min * pow(max / min, (double)i / nbins);
+        break;
+        case HIST_ASINH:{
+            if(scale <= 0.){
+                WARNX(_("Scale of asinh bins should be positive"));
+                FREE(edges);
+                return NULL;
+            }
+            double a0 = asinh(min / scale), a1 = asinh(max / scale);
+            for(size_t i = 0; i <= nbins; ++i) edges[i] = scale * sinh(a0 + (a1 - a0) * i / nbins);
+        }
+        break;
+        default:
+            WARNX(_("Wrong type of bins"));
+            FREE(edges);
+            return NULL;
+    }
+    edges[0] = min; edges[nbins] = max;
+    return edges;
+}
+
+/**
+ * @brief dbl2histogram_edges - calculate histogram of image with given bins
+ *      values below edges[0] and NaNs are counted in first bin, values above edges[nbins]
+ *      (including +inf) - in last
+ * @param im (i)    - input image (not obligatory normalized)
+ * @param edges (i) - `nbins + 1` ascending edges of bins
+ * @param nbins     - amount of bins
+ * @return histogram (allocated here) or NULL if failed
+ */
+histogram *dbl2histogram_edges(const doubleimage *im, const double *edges, size_t nbins){
+    if(!im || !im->data || im->totpix < 1 || !edges || nbins < 1) return NULL;
+    edgesearch s;
+    if(!edgesearch_init(&s, edges, nbins)) return NULL;
+#ifdef EBUG
+    double t0 = dtime();
+#endif
+    initomp();
+    histogram *H = MALLOC(histogram, 1);
+    H->data = MALLOC(size_t, nbins);
+    H->levels = MALLOC(double, nbins + 1);
+    memcpy(H->levels, edges, (nbins + 1) * sizeof(double));
+    H->size = nbins;
     H->totpix = im->totpix;
-    for(size_t i = 0; i < im->totpix; ++i){
-        size_t v = im->data[i] * nvalues;
-        if(v >= nvalues) v = nvalues-1;
-        ++histo[v];
+    privhist p;
+    privhist_init(&p, nbins, im->totpix);
+    size_t nsub = p.nsub;
+    OMP_FOR(num_threads(p.nthreads))
+    for(size_t b = 0; b < p.nblocks; ++b){
+        size_t *h = &p.data[omp_get_thread_num() * p.hsz], idx[HIST_BLKSZ];
+        size_t start = b * HIST_BLKSZ, n = MIN(HIST_BLKSZ, im->totpix - start);
+        edgesearch_block(&s, &im->data[start], n, idx);
+        for(size_t i = 0; i < n; ++i) ++h[idx[i] + (i & (nsub - 1)) * nbins];
     }
-    for(size_t i = 0; i <= nvalues; ++i)
-        lvls[i] = ((double)i) / ((double)nvalues);
+    privhist_merge(&p, H->data);
+    FREE(s.E);
+    DBG("time for histogram with %zd bins by edges: %gs", nbins, dtime() - t0);
     return H;
 }
 
+/**************************************************************************************
+ *                        Look-up tables for intensity remapping                      *
+ **************************************************************************************/
+/*
+ * LUT holds new values for boundaries of histogram levels: for normalized images new value
+ * is linearly interpolated between them, integer images are remapped directly by pixel value.
+ */
+
 /**
- * @brief lininterp - linear interpolation
- * @param bordx - borders by X-axis (xlow, xhigh)
- * @param bordy - borders by Y-axis (ylow, yhigh)
- * @param x     - coordinate of x value
- * @return
- *
-static double lininterp(const double bordx[2], const double bordy[2], double x){
-    return (bordx[0] + (x-bordx[0])*(bordy[1]-bordy[1])/(bordx[1]-bordx[0]));
-}*/
+ * @brief histlut_new - allocate LUT for histogram with `nlevels` levels
+ * @param nlevels - amount of levels
+ * @return LUT with `nlevels + 1` zero values
+ */
+histlut *histlut_new(size_t nlevels){
+    if(nlevels < 1) return NULL;
+    histlut *L = MALLOC(histlut, 1);
+    L->values = MALLOC(double, nlevels + 1);
+    L->size = nlevels;
+    return L;
+}
+
+void histlut_free(histlut **L){
+    if(!L || !*L) return;
+    FREE((*L)->values);
+    FREE((*L)->levels);
+    FREE(*L);
+}
+
+// copy levels of non-uniform histogram into LUT
+static histlut *lut_setlevels(histlut *L, const histogram *H){
+    if(!L || H->uniform || !H->levels) return L;
+    L->levels = MALLOC(double, L->size + 1);
+    memcpy(L->levels, H->levels, (L->size + 1) * sizeof(double));
+    return L;
+}
 
 /**
- * @brief dbl_histcutoff - cutoff histogram of double image with uniform intensity recalculation
- * @param im (io) - image
- * @param nlevls  - amount of levels (2..65535) of histogram
+ * @brief hist2lut_cutoff - make LUT for histogram cut-off with uniform intensity recalculation
+ * @param H (i)   - histogram
  * @param fracbtm - fraction of deleted pixels from zero
  * @param fractop - fraction of deleted pixels from top
- * @return pointer to im (equalized) or NULL
- *      WARNING! Works only for normalized image!
+ * @return LUT or NULL if failed
  */
-doubleimage *dbl_histcutoff(doubleimage *im, size_t nlevls, double fracbtm, double fractop){
-    if(!im || !im->data) return NULL;
-    double success = TRUE; // return OK, if true; NULL if false
+histlut *hist2lut_cutoff(const histogram *H, double fracbtm, double fractop){
+    if(!H || !H->data || !H->levels) return NULL;
     if(fracbtm > 1. || fracbtm < 0.){
         WARNX(_("Bottom fraction should be in [0, 1)"));
         return NULL;
@@ -90,29 +532,23 @@ doubleimage *dbl_histcutoff(doubleimage *im, size_t nlevls, double fracbtm, doub
         WARNX(_("Top fraction should be in (0, 1]"));
         return NULL;
     }
-    histogram *hist = dbl2histogram(im, nlevls);
-    if(!hist || !hist->data || !hist->levels){
-        success = FALSE;
-        goto theret;
-    }
+    size_t nlevls = H->size;
     // prepare data for top & bottom throwing out
-    size_t Nbot = fracbtm * hist->totpix, Ntop = fractop * hist->totpix;
+    size_t Nbot = fracbtm * H->totpix, Ntop = fractop * H->totpix;
     size_t Ncur = 0; // pixel counter
     ssize_t botidx = -1, topidx = (ssize_t)nlevls; // botidx->0, topidx -> 1.
-    DBG("Nbot: %zd, Ntop: %zd, total: %zd", Nbot, Ntop, hist->totpix);
-    if(Nbot + Ntop >= hist->totpix){
-        WARNX(_("No pixels leave to process, have: %zd, need: %zd"), hist->totpix, Nbot + Ntop);
-        success = FALSE;
-        goto theret;
+    DBG("Nbot: %zd, Ntop: %zd, total: %zd", Nbot, Ntop, H->totpix);
+    if(Nbot + Ntop >= H->totpix){
+        WARNX(_("No pixels leave to process, have: %zd, need: %zd"), H->totpix, Nbot + Ntop);
+        return NULL;
     }
-    Ntop = hist->totpix - Ntop;
+    Ntop = H->totpix - Ntop;
     // search lower and upper limits
     for(size_t i = 0; i < nlevls; ++i){
-        Ncur += hist->data[i];
-        DBG("i=%zd, Ncur=%zd", i, Ncur);
+        Ncur += H->data[i];
         if(Ncur > Nbot &&  botidx == -1){
             botidx = i; // found bottom index
-            if(Ntop == hist->totpix) break;
+            if(Ntop == H->totpix) break;
         }else if(Ncur > Ntop){
             topidx = i;
             break;
@@ -120,75 +556,339 @@ doubleimage *dbl_histcutoff(doubleimage *im, size_t nlevls, double fracbtm, doub
     }
     if(botidx < 0){
         WARNX(_("Can't find bottom index"));
-        success = FALSE;
-        goto theret;
+        return NULL;
     }
     // top and bottom values which will be new 0 & 1
-    double botval = hist->levels[botidx]; // lowest value -> 0.
-    double topval = hist->levels[topidx]; // highest value -> 1.
-    DBG("Bot: %zd, Top: %zd, botval: %g, topval: %g", botidx, topidx, botval, topval);
+    double botval = H->levels[botidx]; // lowest value -> 0.
+    double topval = H->levels[topidx]; // highest value -> 1.
     double range = topval - botval; // range -> 1.
-    DBG("botval=%g, topval=%g, range=%g", botval, topval, range);
-    // Now we should convert intensities according to new limits
-    // botidx -> 0., topidx -> 1.
-    OMP_FOR()
-    for(size_t i = 0; i < im->totpix; ++i){// index in old histogram
-        double xx = im->data[i];
+    DBG("Bot: %zd, Top: %zd, botval: %g, topval: %g", botidx, topidx, botval, topval);
+    histlut *L = histlut_new(nlevls);
+    for(size_t i = 0; i <= nlevls; ++i){
+        double xx = H->levels[i];
         if(xx < botval) xx = 0.;
         else xx = (xx - botval) / range;
         if(xx > 1.) xx = 1.;
-        im->data[i] = xx;
+        L->values[i] = xx;
+    }
+    return lut_setlevels(L, H);
+}
+
+/**
+ * @brief hist2lut_equalize - make LUT for histogram equalization
+ * @param H (i) - histogram
+ * @return LUT or NULL if failed
+ */
+histlut *hist2lut_equalize(const histogram *H){
+    if(!H || !H->data || H->totpix < 1) return NULL;
+    histlut *L = histlut_new(H->size);
+    size_t cumul = 0;
+    for(size_t i = 0; i < H->size; ++i){
+        cumul += H->data[i];
+        // calculate new gray level
+        L->values[i+1] = ((double)cumul) / H->totpix;
+    }
+    return lut_setlevels(L, H);
+}
+
+/**
+ * @brief hist2lut_match - make LUT for matching histogram `H` to reference histogram `ref`
+ *      (cumulative distributions are piecewise-linear between levels)
+ * @param H (i)   - histogram of image
+ * @param ref (i) - reference histogram
+ * @return LUT or NULL if failed
+ */
+histlut *hist2lut_match(const histogram *H, const histogram *ref){
+    if(!H || !H->data || H->totpix < 1 || !ref || !ref->data || !ref->levels || ref->totpix < 1) return NULL;
+    histlut *L = histlut_new(H->size);
+    size_t cumul = 0, rcumul = 0, j = 0; // `j` - current bin of reference histogram
+    for(size_t i = 0; i <= H->size; ++i){
+        if(i) cumul += H->data[i-1];
+        double c = ((double)cumul) / H->totpix; // CDF of image at level `i`
+        // find reference bin `j` where its CDF reaches `c`
+        while(j < ref->size && (double)(rcumul + ref->data[j]) / ref->totpix < c) rcumul += ref->data[j++];
+        if(j == ref->size){
+            L->values[i] = ref->levels[j];
+            continue;
+        }
+        double r0 = ((double)rcumul) / ref->totpix, dr = ((double)ref->data[j]) / ref->totpix;
+        double frac = (dr > 0.) ? (c - r0) / dr : 0.;
+        L->values[i] = ref->levels[j] + frac * (ref->levels[j+1] - ref->levels[j]);
+    }
+    return lut_setlevels(L, H);
+}
+
+// apply LUT with non-uniform levels
+static doubleimage *applylut_edges(doubleimage *im, const histlut *L){
+    edgesearch s;
+    if(!edgesearch_init(&s, L->levels, L->size)) return NULL;
+    const double *lut = L->values, *lev = L->levels;
+    size_t n = L->size, totpix = im->totpix;
+    double *slope = MALLOC(double, n); // LUT slope inside each level
+    for(size_t i = 0; i < n; ++i) slope[i] = (lut[i+1] - lut[i]) / (lev[i+1] - lev[i]);
+    OMP_FOR()
+    for(size_t b = 0; b < totpix; b += HIST_BLKSZ){
+        double *d = &im->data[b];
+        size_t e = MIN(HIST_BLKSZ, totpix - b), idx[HIST_BLKSZ];
+        edgesearch_block(&s, d, e, idx);
+        OMP_SIMD()
+        for(size_t i = 0; i < e; ++i){
+            size_t v = idx[i];
+            double x = d[i];
+            x = (x >= lev[0]) ? x : lev[0];
+            x = (x <= lev[n]) ? x : lev[n];
+            d[i] = lut[v] + slope[v] * (x - lev[v]);
+        }
     }
-    theret:
+    FREE(slope);
+    FREE(s.E);
+    return im;
+}
+
+/**
+ * @brief dbl_applylut - remap intensities of image by LUT
+ *      (image should be normalized if LUT is made by histogram with uniform levels)
+ * @param im (io) - image
+ * @param L (i)   - LUT
+ * @return `im` or NULL if failed
+ */
+doubleimage *dbl_applylut(doubleimage *im, const histlut *L){
+    if(!im || !im->data || !L || !L->values) return NULL;
+    if(L->levels) return applylut_edges(im, L);
+    const double *lut = L->values;
+    size_t n = L->size, totpix = im->totpix;
+    double dn = (double)n;
+    OMP_FOR()
+    for(size_t b = 0; b < totpix; b += HIST_BLKSZ){
+        double *d = &im->data[b];
+        size_t e = MIN(HIST_BLKSZ, totpix - b);
+        OMP_SIMD()
+        for(size_t i = 0; i < e; ++i){
+            double dnl = d[i] * dn;
+            dnl = (dnl >= 0.) ? dnl : 0.;
+            dnl = (dnl <= dn) ? dnl : dn;
+            size_t v = (size_t)dnl;
+            v = (v < n) ? v : n - 1;
+            double frac = dnl - v;
+            d[i] = lut[v] + (lut[v+1] - lut[v]) * frac;
+        }
+    }
+    return im;
+}
+
+/**
+ * @brief image_applylut - remap integer image (TBYTE or TUSHORT) by LUT
+ *      (e.g. made for histogram of int2histogram)
+ * @param img (i) - image
+ * @param L (i)   - LUT, pixel with value `v` gets value L->values[v]
+ * @return new double image or NULL if failed
+ */
+doubleimage *image_applylut(const FITSimage *img, const histlut *L){
+    if(!img || !img->data || img->naxis < 2 || !L || !L->values) return NULL;
+    if(img->dtype != TBYTE && img->dtype != TUSHORT){
+        WARNX(_("LUT can be applied only to 8- and 16-bit images"));
+        return NULL;
+    }
+    doubleimage *out = doubleimage_new(img->naxes[0], img->naxes[1]);
+    if(!out) return NULL;
+    const double *lut = L->values;
+    size_t top = L->size, totpix = out->totpix; // values larger than LUT size are set to top value
+    double *o = out->data;
+    if(img->dtype == TBYTE){
+        const uint8_t *d = (const uint8_t*)img->data;
+        OMP_FOR()
+        for(size_t i = 0; i < totpix; ++i) o[i] = lut[MIN(d[i], top)];
+    }else{
+        const uint16_t *d = (const uint16_t*)img->data;
+        OMP_FOR()
+        for(size_t i = 0; i < totpix; ++i) o[i] = lut[MIN(d[i], top)];
+    }
+    return out;
+}
+
+/**
+ * @brief dbl_histcutoff - cutoff histogram of double image with uniform intensity recalculation
+ * @param im (io) - image
+ * @param nlevls  - amount of levels (more than 2) of histogram
+ * @param fracbtm - fraction of deleted pixels from zero
+ * @param fractop - fraction of deleted pixels from top
+ * @return pointer to im (equalized) or NULL
+ *      WARNING! Works only for normalized image!
+ */
+doubleimage *dbl_histcutoff(doubleimage *im, size_t nlevls, double fracbtm, double fractop){
+    if(!im || !im->data) return NULL;
+    histogram *hist = dbl2histogram(im, nlevls);
+    histlut *L = hist2lut_cutoff(hist, fracbtm, fractop);
     histogram_free(&hist);
-    if(success) return im;
-    else return NULL;
+    doubleimage *ret = dbl_applylut(im, L);
+    histlut_free(&L);
+    return ret;
 }
 
 /**
- * @brief dbl_histcutoff - modify image by histogram equalisation
+ * @brief dbl_histcutoff_edges - histogram cut-off of image with given bins (see dbl_histcutoff)
+ * @param im (io)   - image (not obligatory normalized); result is in [0, 1]
+ * @param edges (i) - `nbins + 1` ascending edges of bins
+ * @param nbins     - amount of bins
+ * @param fracbtm   - fraction of deleted pixels from bottom
+ * @param fractop   - fraction of deleted pixels from top
+ * @return pointer to im or NULL
+ */
+doubleimage *dbl_histcutoff_edges(doubleimage *im, const double *edges, size_t nbins, double fracbtm, double fractop){
+    if(!im || !im->data) return NULL;
+    histogram *hist = dbl2histogram_edges(im, edges, nbins);
+    histlut *L = hist2lut_cutoff(hist, fracbtm, fractop);
+    histogram_free(&hist);
+    doubleimage *ret = dbl_applylut(im, L);
+    histlut_free(&L);
+    return ret;
+}
+
+/**
+ * @brief dbl_histeq - modify image by histogram equalisation
  * @param im     - image to transform
- * @param nlevls - levels amount (2..65535)
- * @return
+ * @param nlevls - levels amount (more than 2)
+ * @return pointer to im (equalized) or NULL
  */
 doubleimage *dbl_histeq(doubleimage *im, size_t nlevls){
     if(!im || !im->data) return NULL;
-    double success = TRUE;
     histogram *hist = dbl2histogram(im, nlevls);
-    if(!hist || !hist->data || !hist->levels){
-        success = FALSE;
-        goto theret;
+    histlut *L = hist2lut_equalize(hist);
+    histogram_free(&hist);
+    doubleimage *ret = dbl_applylut(im, L);
+    histlut_free(&L);
+    return ret;
+}
+
+/**
+ * @brief dbl_histeq_edges - histogram equalisation of image with given bins
+ * @param im (io)   - image (not obligatory normalized); result is in [0, 1]
+ * @param edges (i) - `nbins + 1` ascending edges of bins
+ * @param nbins     - amount of bins
+ * @return pointer to im or NULL
+ */
+doubleimage *dbl_histeq_edges(doubleimage *im, const double *edges, size_t nbins){
+    if(!im || !im->data) return NULL;
+    histogram *hist = dbl2histogram_edges(im, edges, nbins);
+    histlut *L = hist2lut_equalize(hist);
+    histogram_free(&hist);
+    doubleimage *ret = dbl_applylut(im, L);
+    histlut_free(&L);
+    return ret;
+}
+
+/**
+ * @brief clahe_axis - calculate indexes of neighbouring tiles and weights for pixels along axis
+ * @param n      - axis length
+ * @param ntiles - amount of tiles along axis
+ * @param i0 (o) - index of tile with center left of (or at) pixel
+ * @param i1 (o) - index of next tile
+ * @param wgt (o) - weight of tile `i1`
+ */
+static void clahe_axis(size_t n, size_t ntiles, size_t *i0, size_t *i1, double *wgt){
+    for(size_t x = 0; x < n; ++x){
+        // tile `i` is [i*n/ntiles, (i+1)*n/ntiles), its center is at (i+0.5)*n/ntiles - 0.5
+        double pos = (x + 0.5) * ntiles / n - 0.5; // coordinate in units of tile centers
+        if(pos <= 0.){
+            i0[x] = i1[x] = 0; wgt[x] = 0.;
+        }else if(pos >= ntiles - 1){
+            i0[x] = i1[x] = ntiles - 1; wgt[x] = 0.;
+        }else{
+            i0[x] = (size_t)pos;
+            i1[x] = i0[x] + 1;
+            wgt[x] = pos - i0[x];
+        }
     }
-    double *newlevels = MALLOC(double, nlevls+1);
-    size_t cumul = 0;
-    for(size_t i = 0; i < nlevls; ++i){
-        cumul += hist->data[i];
-        // calculate new gray level
-        newlevels[i+1] = ((double)cumul) / hist->totpix;
-        DBG("newlevels[%zd]=%g", i+1, newlevels[i+1]);
+}
+
+/**
+ * @brief dbl_clahe - contrast-limited adaptive histogram equalization
+ * Image is divided into ntilesx x ntilesy tiles, equalization LUT of each tile is built by its
+ * clipped histogram, then new values of pixels are bilinearly interpolated between LUTs of four
+ * nearest tiles
+ * @param im (io)   - normalized image to transform
+ * @param ntilesx   - amount of tiles by X
+ * @param ntilesy   - amount of tiles by Y
+ * @param nlevls    - amount of histogram levels (more than 2)
+ * @param cliplimit - max bin value relative to mean bin value of tile (<= 1 for no clipping);
+ *      excess pixels are evenly distributed among all bins
+ * @return pointer to im (equalized) or NULL
+ */
+doubleimage *dbl_clahe(doubleimage *im, size_t ntilesx, size_t ntilesy, size_t nlevls, double cliplimit){
+    if(!im || !im->data || nlevls < 2) return NULL;
+    size_t w = im->width, h = im->height;
+    if(ntilesx < 1 || ntilesy < 1 || ntilesx > w || ntilesy > h){
+        WARNX(_("Wrong amount of tiles"));
+        return NULL;
     }
-    // now we can change image values due to new level
+#ifdef EBUG
+    double t0 = dtime();
+#endif
+    initomp();
+    size_t ntiles = ntilesx * ntilesy, lutsz = nlevls + 1;
+    double *luts = MALLOC(double, ntiles * lutsz), dn = (double)nlevls, top = dn - 1.;
+    // equalization LUTs of tiles
+    OMP_FOR(schedule(dynamic))
+    for(size_t t = 0; t < ntiles; ++t){
+        size_t tx = t % ntilesx, ty = t / ntilesx;
+        size_t x0 = tx * w / ntilesx, x1 = (tx + 1) * w / ntilesx, y0 = ty * h / ntilesy, y1 = (ty + 1) * h / ntilesy;
+        histogram H = {.data = MALLOC(size_t, nlevls), .size = nlevls, .totpix = (x1 - x0) * (y1 - y0), .uniform = TRUE};
+        for(size_t y = y0; y < y1; ++y){
+            const double *d = &im->data[y * w];
+            for(size_t x = x0; x < x1; ++x){
+                double v = d[x] * dn;
+                v = (v >= 0.) ? v : 0.;
+                v = (v < top) ? v : top;
+                ++H.data[(size_t)v];
+            }
+        }
+        if(cliplimit > 1.){
+            size_t limit = (size_t)(cliplimit * H.totpix / nlevls), excess = 0;
+            if(limit < 1) limit = 1;
+            for(size_t i = 0; i < nlevls; ++i)
+                if(H.data[i] > limit){
+                    excess += H.data[i] - limit;
+                    H.data[i] = limit;
+                }
+            size_t add = excess / nlevls, rest = excess % nlevls;
+            for(size_t i = 0; i < nlevls; ++i) H.data[i] += add;
+            // distribute remainder evenly over the range
+            for(size_t i = 0; i < rest; ++i) ++H.data[i * nlevls / rest];
+        }
+        histlut *L = hist2lut_equalize(&H);
+        memcpy(&luts[t * lutsz], L->values, lutsz * sizeof(double));
+        histlut_free(&L);
+        FREE(H.data);
+    }
+    // neighbouring tiles and weights for each column and row
+    size_t *xi0 = MALLOC(size_t, w), *xi1 = MALLOC(size_t, w), *yi0 = MALLOC(size_t, h), *yi1 = MALLOC(size_t, h);
+    double *wx = MALLOC(double, w), *wy = MALLOC(double, h);
+    clahe_axis(w, ntilesx, xi0, xi1, wx);
+    clahe_axis(h, ntilesy, yi0, yi1, wy);
     OMP_FOR()
-    for(size_t i = 0; i < im->totpix; ++i){
-        double d = im->data[i];
-        double dnl = d * nlevls;
-        size_t v = (size_t)dnl;
-        if(v >= nlevls){
-            v = nlevls-1;
-        }
-        double frac = dnl - v;
-        if(frac < 0.){
-            DBG("frac=%g<0", frac);
-            frac = 0.;
-        }else if(frac > 1.){
-            DBG("frac=%g>1", frac);
-            frac = 1;
-        }
-        im->data[i] = (newlevels[v+1] - newlevels[v]) * frac + newlevels[v];
-    }
-    FREE(newlevels);
-    theret:
-    histogram_free(&hist);
-    if(success) return im;
-    else return NULL;
+    for(size_t y = 0; y < h; ++y){
+        double *d = &im->data[y * w], ky = wy[y];
+        const double *lrow0 = &luts[yi0[y] * ntilesx * lutsz], *lrow1 = &luts[yi1[y] * ntilesx * lutsz];
+        OMP_SIMD()
+        for(size_t x = 0; x < w; ++x){
+            double dnl = d[x] * dn;
+            dnl = (dnl >= 0.) ? dnl : 0.;
+            dnl = (dnl <= dn) ? dnl : dn;
+            size_t v = (size_t)dnl;
+            v = (v < nlevls) ? v : nlevls - 1;
+            double frac = dnl - v, kx = wx[x];
+            size_t o0 = xi0[x] * lutsz + v, o1 = xi1[x] * lutsz + v;
+            #define LUTVAL(l, o)  (l[o] + (l[o + 1] - l[o]) * frac)
+            double vtop = LUTVAL(lrow0, o0) + kx * (LUTVAL(lrow0, o1) - LUTVAL(lrow0, o0));
+            double vbot = LUTVAL(lrow1, o0) + kx * (LUTVAL(lrow1, o1) - LUTVAL(lrow1, o0));
+            #undef LUTVAL
+            d[x] = vtop + ky * (vbot - vtop);
+        }
+    }
+    FREE(xi0); FREE(xi1); FREE(yi0); FREE(yi1);
+    FREE(wx); FREE(wy);
+    FREE(luts);
+    DBG("time for CLAHE (%zdx%zd tiles, %zd levels) of image %zdx%zd: %gs", ntilesx, ntilesy, nlevls,
+        w, h, dtime() - t0);
+    return im;
 }
@@ -0,0 +1,327 @@
+/*
+ * This file is part of the FITSmaniplib project.
+ * Copyright 2019  Edward V. Emelianov <edward.emelianoff@gmail.com>, <eddy@sao.ru>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "FITSmanip.h"
+#include "local.h"
+#include <omp.h>
+#include <stdio.h>
+#include <zlib.h>
+
+/**************************************************************************************
+ *                           Writing of PNG and PNM previews                          *
+ **************************************************************************************/
+/*
+ * Input is 8-bit gray, RGB or RGBA (like output of convert2palette) or 16-bit gray in
+ * host byte order. As FITS images have origin at left bottom corner, rows are written
+ * from last to first.
+ * PNG data is compressed by groups of rows in parallel (like pigz does): each group is
+ * filtered and deflated independently with last 32k of previous group as dictionary
+ * and ends with sync flush, so concatenated groups form one zlib stream. Groups are
+ * processed by batches, so memory consumption doesn't depend on image size.
+ */
+
+// size of row group (in bytes of raw data)
+#define PNG_GROUPSZ         (1<<18)
+// deflate window size (max size of dictionary)
+#define PNG_WINDOW          (1<<15)
+// level of compression
+#define PNG_ZLEVEL          (6)
+
+// check parameters of image
+static bool check_format(const uint8_t *data, size_t w, size_t h, int nchannels, int bitdepth){
+    if(!data || w < 1 || h < 1){
+        WARNX(_("Wrong image"));
+        return FALSE;
+    }
+    if(bitdepth == 16){
+        if(nchannels != 1){
+            WARNX(_("16-bit images can be only grayscale"));
+            return FALSE;
+        }
+    }else if(bitdepth != 8 || (nchannels != 1 && nchannels != 3 && nchannels != 4)){
+        WARNX(_("Wrong image format: %d channels, %d bits"), nchannels, bitdepth);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+// copy row `y` of image into `dst` with 16-bit values in big-endian order
+static void get_row(const uint8_t *data, size_t rowsz, size_t y, int bitdepth, uint8_t *dst){
+    const uint8_t *src = &data[y * rowsz];
+    if(bitdepth == 8){
+        memcpy(dst, src, rowsz);
+        return;
+    }
+    const uint16_t *s16 = (const uint16_t*)src;
+    size_t n = rowsz / 2;
+    for(size_t i = 0; i < n; ++i){
+        dst[2*i] = s16[i] >> 8;
+        dst[2*i+1] = s16[i] & 0xff;
+    }
+}
+
+static inline uint8_t paeth(int a, int b, int c){
+    int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if(pa <= pb && pa <= pc) return a;
+    return (pb <= pc) ? b : c;
+}
+
+/**
+ * @brief filter_row - filter row choosing filter with minimal sum of absolute differences
+ * @param cur (i)  - current row
+ * @param prev (i) - previous row (zeros for first row)
+ * @param n        - row length in bytes
+ * @param bpp      - bytes per pixel
+ * @param out (o)  - filtered row: filter type and `n` bytes
+ * @param tmp      - working buffer (`n` bytes)
+ */
+static void filter_row(const uint8_t *cur, const uint8_t *prev, size_t n, size_t bpp, uint8_t *out, uint8_t *tmp){
+    uint8_t *best = out + 1;
+    int bestf = 0;
+    size_t bestsum = 0;
+    memcpy(best, cur, n);
+    for(size_t i = 0; i < n; ++i) bestsum += abs((int8_t)cur[i]);
+    for(int f = 1; f < 5; ++f){
+        switch(f){
+            case 1: // sub
+                for(size_t i = 0; i < bpp; ++i) tmp[i] = cur[i];
+                OMP_SIMD()
+                for(size_t i = bpp; i < n; ++i) tmp[i] = cur[i] - cur[i-bpp];
+            break;
+            case 2: // up
+                OMP_SIMD()
+                for(size_t i = 0; i < n; ++i) tmp[i] = cur[i] - prev[i];
+            break;
+            case 3: // average
+                for(size_t i = 0; i < bpp; ++i) tmp[i] = cur[i] - (prev[i] >> 1);
+                OMP_SIMD()
+                for(size_t i = bpp; i < n; ++i) tmp[i] = cur[i] - ((cur[i-bpp] + prev[i]) >> 1);
+            break;
+            default: // paeth
+                for(size_t i = 0; i < bpp; ++i) tmp[i] = cur[i] - prev[i];
+                for(size_t i = bpp; i < n; ++i) tmp[i] = cur[i] - paeth(cur[i-bpp], prev[i], prev[i-bpp]);
+        }
+        size_t sum = 0;
+        OMP_SIMD(reduction(+:sum))
+        for(size_t i = 0; i < n; ++i) sum += abs((int8_t)tmp[i]);
+        if(sum < bestsum){
+            bestsum = sum;
+            bestf = f;
+            memcpy(best, tmp, n);
+        }
+    }
+    out[0] = (uint8_t)bestf;
+}
+
+// compressed group of rows
+typedef struct{
+    uint8_t *raw;       // filtered rows
+    size_t rawsz;       // their size
+    uint8_t *z;         // deflated data
+    size_t zsz;         // its size
+    uLong adler;        // adler32 of `raw`
+} pnggroup;
+
+static void put32(uint8_t *p, uint32_t v){
+    p[0] = v >> 24; p[1] = (v >> 16) & 0xff; p[2] = (v >> 8) & 0xff; p[3] = v & 0xff;
+}
+
+// write PNG chunk
+static bool png_chunk(FILE *f, const char *type, const uint8_t *data, size_t len){
+    uint8_t hdr[8];
+    put32(hdr, (uint32_t)len);
+    memcpy(hdr + 4, type, 4);
+    uLong crc = crc32(0L, (const Bytef*)type, 4);
+    if(len) crc = crc32(crc, data, (uInt)len);
+    uint8_t c[4];
+    put32(c, (uint32_t)crc);
+    if(fwrite(hdr, 8, 1, f) != 1) return FALSE;
+    if(len && fwrite(data, len, 1, f) != 1) return FALSE;
+    return fwrite(c, 4, 1, f) == 1;
+}
+
+/**
+ * @brief deflate_group - compress filtered rows of group
+ * @param g (io)   - group
+ * @param dict (i) - dictionary (end of previous group) or NULL
+ * @param dictsz   - its size
+ * @param last     - TRUE for last group of image
+ * @return FALSE if failed
+ */
+static bool deflate_group(pnggroup *g, const uint8_t *dict, size_t dictsz, bool last){
+    z_stream z = {0};
+    if(deflateInit2(&z, PNG_ZLEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) return FALSE;
+    // without dictionary back-references into previous group would be wrong
+    if(dict && dictsz && deflateSetDictionary(&z, dict, (uInt)dictsz) != Z_OK){
+        deflateEnd(&z);
+        return FALSE;
+    }
+    size_t bound = deflateBound(&z, g->rawsz) + 16;
+    g->z = MALLOC(uint8_t, bound);
+    z.next_in = g->raw;
+    z.avail_in = (uInt)g->rawsz;
+    z.next_out = g->z;
+    z.avail_out = (uInt)bound;
+    int r = deflate(&z, last ? Z_FINISH : Z_SYNC_FLUSH);
+    g->zsz = bound - z.avail_out;
+    deflateEnd(&z);
+    g->adler = adler32(1L, g->raw, (uInt)g->rawsz);
+    return (r == (last ? Z_STREAM_END : Z_OK)) && z.avail_in == 0;
+}
+
+/**
+ * @brief write_png - save image as PNG
+ * @param filename  - output file name
+ * @param data (i)  - image data (rows from bottom to top)
+ * @param w, h      - image size
+ * @param nchannels - 1 (gray), 3 (RGB) or 4 (RGBA)
+ * @param bitdepth  - 8 or 16 (16 only for gray; values in host byte order)
+ * @return FALSE if failed
+ */
+bool write_png(const char *filename, const uint8_t *data, size_t w, size_t h, int nchannels, int bitdepth){
+    if(!filename || !check_format(data, w, h, nchannels, bitdepth)) return FALSE;
+    FILE *f = fopen(filename, "wb");
+    if(!f){
+        WARN(_("Can't open %s"), filename);
+        return FALSE;
+    }
+#ifdef EBUG
+    double t0 = dtime();
+#endif
+    bool ret = FALSE;
+    size_t bpp = nchannels * bitdepth / 8, rowsz = w * bpp;
+    static const uint8_t sig[8] = {137, 'P', 'N', 'G', '\r', '\n', 26, '\n'};
+    uint8_t ihdr[13];
+    put32(ihdr, (uint32_t)w);
+    put32(ihdr + 4, (uint32_t)h);
+    ihdr[8] = (uint8_t)bitdepth;
+    ihdr[9] = (nchannels == 1) ? 0 : (nchannels == 3) ? 2 : 6;
+    ihdr[10] = ihdr[11] = ihdr[12] = 0;
+    if(fwrite(sig, 8, 1, f) != 1 || !png_chunk(f, "IHDR", ihdr, 13)) goto ret;
+    initomp();
+    size_t grows = MAX(1, PNG_GROUPSZ / rowsz), ngroups = (h + grows - 1) / grows;
+    size_t batch = 2 * omp_get_max_threads();
+    pnggroup *G = MALLOC(pnggroup, batch);
+    uint8_t *dict = MALLOC(uint8_t, PNG_WINDOW);
+    size_t dictsz = 0;
+    uLong adler = adler32(0L, Z_NULL, 0);
+    static const uint8_t zhdr[2] = {0x78, 0x9c};
+    if(!png_chunk(f, "IDAT", zhdr, 2)) goto fr;
+    for(size_t g0 = 0; g0 < ngroups; g0 += batch){
+        size_t nb = MIN(batch, ngroups - g0);
+        // filter rows (output row `r` is image row `h-1-r`)
+        OMP_FOR()
+        for(size_t j = 0; j < nb; ++j){
+            size_t r0 = (g0 + j) * grows, r1 = MIN(r0 + grows, h);
+            pnggroup *g = &G[j];
+            g->rawsz = (r1 - r0) * (rowsz + 1);
+            g->raw = MALLOC(uint8_t, g->rawsz);
+            uint8_t *cur = MALLOC(uint8_t, rowsz), *prev = MALLOC(uint8_t, rowsz), *tmp = MALLOC(uint8_t, rowsz);
+            if(r0) get_row(data, rowsz, h - r0, bitdepth, prev);
+            for(size_t r = r0; r < r1; ++r){
+                get_row(data, rowsz, h - 1 - r, bitdepth, cur);
+                filter_row(cur, prev, rowsz, bpp, &g->raw[(r - r0) * (rowsz + 1)], tmp);
+                uint8_t *t = prev; prev = cur; cur = t;
+            }
+            FREE(cur); FREE(prev); FREE(tmp);
+        }
+        // deflate groups: dictionary of each group is end of previous one
+        bool good = TRUE;
+        OMP_FOR()
+        for(size_t j = 0; j < nb; ++j){
+            const uint8_t *d = dict;
+            size_t dsz = dictsz;
+            if(j){
+                dsz = MIN(PNG_WINDOW, G[j-1].rawsz);
+                d = G[j-1].raw + G[j-1].rawsz - dsz;
+            }
+            if(!deflate_group(&G[j], d, dsz, g0 + j == ngroups - 1)) good = FALSE;
+        }
+        // write them
+        for(size_t j = 0; j < nb; ++j){
+            if(good && !png_chunk(f, "IDAT", G[j].z, G[j].zsz)) good = FALSE;
+            adler = adler32_combine(adler, G[j].adler, (z_off_t)G[j].rawsz);
+        }
+        // keep end of last group for next batch
+        pnggroup *l = &G[nb-1];
+        if(l->rawsz >= PNG_WINDOW){
+            dictsz = PNG_WINDOW;
+            memcpy(dict, l->raw + l->rawsz - PNG_WINDOW, PNG_WINDOW);
+        }else{ // short group: append it to previous dictionary
+            size_t keep = MIN(dictsz, PNG_WINDOW - l->rawsz);
+            memmove(dict, dict + dictsz - keep, keep);
+            memcpy(dict + keep, l->raw, l->rawsz);
+            dictsz = keep + l->rawsz;
+        }
+        for(size_t j = 0; j < nb; ++j){
+            FREE(G[j].raw);
+            FREE(G[j].z);
+        }
+        if(!good){
+            WARNX(_("Can't compress image"));
+            goto fr;
+        }
+    }
+    uint8_t a[4];
+    put32(a, (uint32_t)adler);
+    if(png_chunk(f, "IDAT", a, 4) && png_chunk(f, "IEND", NULL, 0)) ret = TRUE;
+fr:
+    FREE(G);
+    FREE(dict);
+ret:
+    if(fclose(f)) ret = FALSE;
+    if(!ret) WARNX(_("Can't write %s"), filename);
+    DBG("time for writing PNG %zdx%zd: %gs", w, h, dtime() - t0);
+    return ret;
+}
+
+/**
+ * @brief write_pnm - save image as binary PGM (gray) or PPM (colour; alpha channel is dropped)
+ * @param filename  - output file name
+ * @param data (i)  - image data (rows from bottom to top)
+ * @param w, h      - image size
+ * @param nchannels - 1 (gray), 3 (RGB) or 4 (RGBA)
+ * @param bitdepth  - 8 or 16 (16 only for gray; values in host byte order)
+ * @return FALSE if failed
+ */
+bool write_pnm(const char *filename, const uint8_t *data, size_t w, size_t h, int nchannels, int bitdepth){
+    if(!filename || !check_format(data, w, h, nchannels, bitdepth)) return FALSE;
+    FILE *f = fopen(filename, "wb");
+    if(!f){
+        WARN(_("Can't open %s"), filename);
+        return FALSE;
+    }
+    size_t bpp = nchannels * bitdepth / 8, rowsz = w * bpp, outsz = (nchannels == 4) ? w * 3 : rowsz;
+    bool ret = fprintf(f, "P%c\n%zd %zd\n%d\n", (nchannels == 1) ? '5' : '6', w, h, (bitdepth == 8) ? 255 : 65535) > 0;
+    uint8_t *row = MALLOC(uint8_t, rowsz);
+    for(size_t y = h; ret && y-- > 0;){
+        const uint8_t *out = &data[y * rowsz];
+        if(bitdepth == 16){
+            get_row(data, rowsz, y, bitdepth, row);
+            out = row;
+        }else if(nchannels == 4){
+            for(size_t x = 0; x < w; ++x) memcpy(&row[3*x], &out[4*x], 3);
+            out = row;
+        }
+        if(fwrite(out, outsz, 1, f) != 1) ret = FALSE;
+    }
+    FREE(row);
+    if(fclose(f)) ret = FALSE;
+    if(!ret) WARNX(_("Can't write %s"), filename);
+    return ret;
+}
@@ -20,18 +20,17 @@
 // Copyright (c) 2011 ashelly.myopenid.com under <http://www.opensource.org/licenses/mit-license>
 // FOR opt_medXX:
 // Copyright (c) 1998 Nicolas Devillard. Public domain.
-// FOR qickselect:
-// "Numerical recipes in C", Second Edition,
-//  Cambridge University Press, 1992, Section 8.5, ISBN 0-521-43108-5
-//  Code by Nicolas Devillard - 1998. Public domain.
-
-// TODO: resolve problem with borders
+// FOR selection:
+// R. W. Floyd, R. L. Rivest, "Algorithm 489: SELECT", CACM 18(3), 1975
 
 #include "FITSmanip.h"
 #include "local.h"
+#include <omp.h>
 
 // largest radius for adaptive median filter
 #define LARGEST_ADPMED_RADIUS  (3)
+// size of cache for window rows in Mediator-based filter
+#define MEDIAN_CACHESZ  (1<<18)
 
 #define ELEM_SWAP(a, b) {register double t = a; a = b; b = t;}
 #define PIX_SORT(a, b)  {if (p[a] > p[b]) ELEM_SWAP(p[a], p[b]);}
@@ -149,50 +148,95 @@ static double opt_med25(double *p){
 }
 #undef PIX_SORT
 
-#define PIX_SORT(a, b)  {if (a > b) ELEM_SWAP(a, b);}
+/*
+ * Allocation-free selection: all functions reorder input array in-place.
+ * Floyd-Rivest algorithm (SELECT, CACM 1975): for large segments k-th element is found in
+ * small random sample first, so partition around it leaves small part of array only.
+ * After xx_select(a, n, k) a[i] <= a[k] for i < k and a[i] >= a[k] for i > k.
+ * Arrays shouldn't contain NaNs.
+ */
+// segments larger than this are sampled before partitioning
+#define FR_SAMPLE_MIN   (600)
+// segments smaller than this are sorted by insertion
+#define INSSORT_MAX     (16)
+
+#define SELECT_FUNCS(type, pfx) \
+static void pfx ## _fr(type *a, ssize_t left, ssize_t right, ssize_t k){ \
+	while(right > left){ \
+		if(right - left < INSSORT_MAX){ \
+			for(ssize_t i = left + 1; i <= right; ++i){ \
+				type v = a[i]; ssize_t j = i - 1; \
+				for(; j >= left && a[j] > v; --j) a[j+1] = a[j]; \
+				a[j+1] = v; \
+			} \
+			return; \
+		} \
+		if(right - left > FR_SAMPLE_MIN){ \
+			double n = right - left + 1, i = k - left + 1, z = log(n), s = 0.5 * exp(2. * z / 3.); \
+			double sd = 0.5 * sqrt(z * s * (n - s) / n) * (i < n / 2. ? -1. : 1.); \
+			ssize_t nl = (ssize_t)(k - i * s / n + sd), nr = (ssize_t)(k + (n - i) * s / n + sd); \
+			pfx ## _fr(a, MAX(left, nl), MIN(right, nr), k); \
+		} \
+		type t = a[k], tmp; \
+		ssize_t i = left, j = right; \
+		tmp = a[left]; a[left] = a[k]; a[k] = tmp; \
+		if(a[right] > t){tmp = a[right]; a[right] = a[left]; a[left] = tmp;} \
+		while(i < j){ \
+			tmp = a[i]; a[i] = a[j]; a[j] = tmp; \
+			++i; --j; \
+			while(a[i] < t) ++i; \
+			while(a[j] > t) --j; \
+		} \
+		if(a[left] == t){tmp = a[left]; a[left] = a[j]; a[j] = tmp;} \
+		else{++j; tmp = a[j]; a[j] = a[right]; a[right] = tmp;} \
+		if(j <= k) left = j + 1; \
+		if(k <= j) right = j - 1; \
+	} \
+} \
+type pfx ## _select(type *a, size_t n, size_t k){ \
+	if(!a || n < 1 || k >= n) return (type)0; \
+	pfx ## _fr(a, 0, (ssize_t)n - 1, (ssize_t)k); \
+	return a[k]; \
+} \
+static void pfx ## _msel(type *a, size_t n, const size_t *k, size_t nk, size_t offset){ \
+	if(nk == 0 || n < 2) return; \
+	size_t mid = nk / 2, km = k[mid] - offset; \
+	pfx ## _fr(a, 0, (ssize_t)n - 1, (ssize_t)km); \
+	pfx ## _msel(a, km, k, mid, offset); \
+	pfx ## _msel(a + km + 1, n - km - 1, k + mid + 1, nk - mid - 1, offset + km + 1); \
+} \
+void pfx ## _multiselect(type *a, size_t n, const size_t *k, size_t nk){ \
+	if(!a || !k || n < 1) return; \
+	for(size_t i = 0; i < nk; ++i) if(k[i] >= n || (i && k[i] <= k[i-1])){ \
+		WARNX(_("Indexes for multiselect should be sorted and less than array length")); \
+		return; \
+	} \
+	pfx ## _msel(a, n, k, nk, 0); \
+}
+
 /**
- * @brief quick_select - algorithm for approximate median calculation for array idata of size n
+ * @brief xx_select - find k-th smallest element of array `a` with length `n` (in-place)
+ * @brief xx_multiselect - find `nk` elements with indexes `k` (sorted ascending), so after
+ *      it a[k[i]] are the same as in sorted array and array is partitioned around them
+ * xx = dbl for double, flt for float, u16 for uint16_t, u32 for uint32_t
+ */
+SELECT_FUNCS(double, dbl)
+SELECT_FUNCS(float, flt)
+SELECT_FUNCS(uint16_t, u16)
+SELECT_FUNCS(uint32_t, u32)
+#undef SELECT_FUNCS
+
+/**
+ * @brief quick_select - calculate median (lower for even `n`) of array idata of size n
  * @param idata (i) - input data array
  * @param n - size of `idata`
  * @return median value
  */
 double quick_select(const double *idata, int n){
-	int low, high;
-	int median;
-	int middle, ll, hh;
+	if(!idata || n < 1) return 0.;
 	double *arr = MALLOC(double, n);
 	memcpy(arr, idata, n*sizeof(double));
-	low = 0 ; high = n-1 ; median = (low + high) / 2;
-	for(;;){
-		if(high <= low) // One element only
-			break;
-		if(high == low + 1){ // Two elements only
-			PIX_SORT(arr[low], arr[high]) ;
-			break;
-		}
-		// Find median of low, middle and high doubles; swap into position low
-		middle = (low + high) / 2;
-		PIX_SORT(arr[middle], arr[high]) ;
-		PIX_SORT(arr[low], arr[high]) ;
-		PIX_SORT(arr[middle], arr[low]) ;
-		// Swap low double (now in position middle) into position (low+1)
-		ELEM_SWAP(arr[middle], arr[low+1]) ;
-		// Nibble from each end towards middle, swapping doubles when stuck
-		ll = low + 1;
-		hh = high;
-		for(;;){
-			do ll++; while (arr[low] > arr[ll]);
-			do hh--; while (arr[hh] > arr[low]);
-			if(hh < ll) break;
-			ELEM_SWAP(arr[ll], arr[hh]) ;
-		}
-		// Swap middle double (in position low) back into correct position
-		ELEM_SWAP(arr[low], arr[hh]) ;
-		// Re-set active partition
-		if (hh <= median) low = ll;
-		if (hh >= median) high = hh - 1;
-	}
-	double ret = arr[median];
+	double ret = dbl_select(arr, n, (n - 1) / 2);
 	FREE(arr);
 	return ret;
 }
@@ -200,35 +244,49 @@ double quick_select(const double *idata, int n){
 #undef ELEM_SWAP
 
 /**
- * @brief calc_median - calculate median of array idata with size n
+ * @brief calc_median_buf - calculate median of array idata with size n without memory allocation
  *      the specific type of algorythm is choosen according to `n`
  * @param idata (i) - input data array
  * @param n - size of array `idata`
+ * @param buf - buffer for `n` values (could be equal to `idata`: then it would be reordered)
  * @return median value
  */
-double calc_median(const double *idata, int n){
-    if(!idata || n < 1){
-        WARNX(_("Wrong parameters"));
-        return 0.;
-    }
+double calc_median_buf(const double *idata, size_t n, double *buf){
+	if(!idata || !buf || n < 1){
+		WARNX(_("Wrong parameters"));
+		return 0.;
+	}
 	typedef double (*medfunc)(double *p);
 	medfunc fn = NULL;
 	const medfunc fnarr[] = {opt_med2, opt_med3, opt_med4, opt_med5, opt_med6,
 			opt_med7, opt_med8, opt_med9};
 	if(n == 1) return *idata;
+	if(buf != idata) memcpy(buf, idata, sizeof(double)*n);
 	if(n < 10) fn = fnarr[n - 2];
 	else if(n == 16) fn = opt_med16;
 	else if(n == 25) fn = opt_med25;
-	if(fn){
-        // copy data to new buffer - `idata` should leave unchanged
-        double *dataarr = MALLOC(double, n);
-        memcpy(dataarr, idata, sizeof(double)*n);
-        double medval = fn(dataarr);
-        FREE(dataarr);
-		return medval;
-	}else{
-		return quick_select(idata, n);
+	if(fn) return fn(buf);
+	return dbl_select(buf, n, (n - 1) / 2);
+}
+
+/**
+ * @brief calc_median - calculate median of array idata with size n
+ *      the specific type of algorythm is choosen according to `n`
+ * @param idata (i) - input data array
+ * @param n - size of array `idata`
+ * @return median value
+ */
+double calc_median(const double *idata, int n){
+	if(!idata || n < 1){
+		WARNX(_("Wrong parameters"));
+		return 0.;
 	}
+	if(n == 1) return *idata;
+	// copy data to new buffer - `idata` should leave unchanged
+	double *dataarr = MALLOC(double, n);
+	double medval = calc_median_buf(idata, n, dataarr);
+	FREE(dataarr);
+	return medval;
 }
 
 #define doubleLess(a,b) ((a)<(b))
@@ -300,11 +358,11 @@ static int maxSortUp(Mediator* m, int i){
 
 /*--- Public Interface ---*/
 
-//creates new Mediator: to calculate `ndoubles` running median.
-//mallocs single block of memory, caller must free.
-static Mediator* MediatorNew(int ndoubles){
-	int size = sizeof(Mediator) + ndoubles*(sizeof(double)+sizeof(int)*2);
-	Mediator* m = malloc(size);
+// size of memory block for Mediator
+#define MediatorSize(ndoubles)  (sizeof(Mediator) + (ndoubles)*(sizeof(double)+sizeof(int)*2))
+
+//initialize Mediator in memory block `m` of size MediatorSize(ndoubles)
+static Mediator* MediatorInit(Mediator *m, int ndoubles){
 	m->data = (double*)(m + 1);
 	m->pos = (int*) (m->data + ndoubles);
 	m->heap = m->pos + ndoubles + (ndoubles / 2); //points to middle of storage.
@@ -317,6 +375,12 @@ static Mediator* MediatorNew(int ndoubles){
 	return m;
 }
 
+//creates new Mediator: to calculate `ndoubles` running median.
+//mallocs single block of memory, caller must free.
+static Mediator* MediatorNew(int ndoubles){
+	return MediatorInit(malloc(MediatorSize(ndoubles)), ndoubles);
+}
+
 //Inserts double, maintains median in O(lg ndoubles)
 static void MediatorInsert(Mediator* m, double v){
 	int isNew=(m->ct<m->N);
@@ -363,336 +427,956 @@ static double MediatorStat(Mediator* m, double *minval, double *maxval){
 	return v;
 }*/
 
-// TODO: add adaptive filtering
+/*
+ * Median filters with small windows (cross 3x3, 3x3, 5x5 and 7x7) by sorting networks
+ * applied to many pixels at once: each "wire" of network is an array of values for all
+ * pixels of tile row, so compare-exchange operations are vectorized.
+ * For square windows columns of tile are sorted once (these sorts are shared by `blksz`
+ * neighbouring windows), then rows of each window are sorted. In matrix with sorted
+ * rows and columns the element (i, j) has at least (i+1)*(j+1) elements not greater
+ * than it and (k-i)*(k-j) elements not less than it, so most of elements can't be
+ * median: only the rest (13 of 25 for 5x5) goes to final sorting network.
+ */
+
+// max radius for filtering by sorting networks
+#define MEDNET_MAXRADIUS    (3)
+// amount of pixels processed at once
+#define MEDNET_TILE         (128)
+// max amount of compare-exchange operations in one network
+#define MEDNET_MAXPAIRS     (256)
+
+// sorting network: pairs of wires for compare-exchange
+typedef struct{
+	int npairs;
+	int a[MEDNET_MAXPAIRS];
+	int b[MEDNET_MAXPAIRS];
+} sortnet;
+
 /**
- * @brief get_adp_median_cross - adaptive median filter by cross 3x3
- * We have 5 datapoints and 4 inserts @ each step, so it's better to use opt_med5 instead of Mediator
+ * @brief mksortnet - make Batcher's odd-even merge sorting network for `n` elements
+ * @param n   - amount of elements
+ * @param net (o) - network
+ */
+static void mksortnet(int n, sortnet *net){
+	net->npairs = 0;
+	for(int p = 1; p < n; p <<= 1)
+		for(int k = p; k >= 1; k >>= 1)
+			for(int j = k % p; j + k < n; j += 2*k)
+				for(int i = 0; i < MIN(k, n - j - k); ++i)
+					if((i + j) / (2*p) == (i + j + k) / (2*p)){
+						net->a[net->npairs] = i + j;
+						net->b[net->npairs] = i + j + k;
+						++net->npairs;
+					}
+}
+
+// compare-exchange of two wires with `n` values: after it a[i] <= b[i]
+static inline void ce_wires(double *restrict a, double *restrict b, size_t n){
+	OMP_SIMD()
+	for(size_t l = 0; l < n; ++l){
+		double x = a[l], y = b[l];
+		a[l] = MIN(x, y);
+		b[l] = MAX(x, y);
+	}
+}
+
+// apply sorting network to wires
+static inline void sort_wires(double **w, const sortnet *net, size_t n){
+	for(int i = 0; i < net->npairs; ++i) ce_wires(w[net->a[i]], w[net->b[i]], n);
+}
+
+/**
+ * @brief mednet_cross - median filtering of inner part of image by cross 3x3
  * @param img (i) - input image
- * @param out (o) - output image (allocated outside)
- * @param adp - TRUE for adaptive filtering and FALSE for regular
+ * @param out (o) - output image
  */
-static void get_adp_median_cross(const doubleimage *img, doubleimage *out, _U_ bool adp){
+static void mednet_cross(const doubleimage *img, doubleimage *out){
 	size_t w = img->width, h = img->height;
-	double *med = out->data, *inputima = img->data, *iptr;
+	if(w < 3 || h < 3) return;
+	// network of opt_med5
+	static const sortnet med5 = {7, {0, 3, 0, 1, 1, 2, 1}, {1, 4, 3, 4, 2, 3, 2}};
+	double *med = out->data, *inputima = img->data;
+	OMP_FOR()
+	for(size_t y = 1; y < h - 1; ++y){
+		double buf[5][MEDNET_TILE], *wires[5] = {buf[0], buf[1], buf[2], buf[3], buf[4]};
+		const double *row = &inputima[y * w];
+		for(size_t xs = 1; xs < w - 1; xs += MEDNET_TILE){
+			size_t T = MIN(MEDNET_TILE, w - 1 - xs);
+			const double *r = &row[xs];
+			memcpy(buf[0], r - 1, T * sizeof(double));
+			memcpy(buf[1], r, T * sizeof(double));
+			memcpy(buf[2], r + 1, T * sizeof(double));
+			memcpy(buf[3], r - w, T * sizeof(double));
+			memcpy(buf[4], r + w, T * sizeof(double));
+			sort_wires(wires, &med5, T);
+			memcpy(&med[y * w + xs], buf[2], T * sizeof(double));
+		}
+	}
+}
+
+/**
+ * @brief mednet_inner - median filtering of inner part of image by square window
+ * @param img (i) - input image
+ * @param out (o) - output image
+ * @param radius  - window radius (1..MEDNET_MAXRADIUS)
+ */
+static void mednet_inner(const doubleimage *img, doubleimage *out, size_t radius){
+	size_t w = img->width, h = img->height, k = 2*radius + 1;
+	if(w < k || h < k) return;
+	int K = (int)k, M = (K*K - 1) / 2; // M - rank of median
+	sortnet colnet, candnet;
+	mksortnet(K, &colnet); // the same network sorts columns and rows
+	// candidates to median
+	int cand[MEDNET_MAXPAIRS], ncand = 0, nlow = 0;
+	for(int i = 0; i < K; ++i) for(int j = 0; j < K; ++j){
+		int nle = (i + 1) * (j + 1), nge = (K - i) * (K - j);
+		if(nge > M + 1) ++nlow; // below median
+		else if(nle <= M + 1) cand[ncand++] = i*K + j;
+	}
+	mksortnet(ncand, &candnet);
+	int rank = M - nlow; // rank of median among candidates
+	DBG("%d candidates, median rank: %d", ncand, rank);
+	double *med = out->data, *inputima = img->data;
+	size_t W = MEDNET_TILE + 2*radius; // width of column wires
+	OMP_FOR()
+	for(size_t y = radius; y < h - radius; ++y){
+		double *colbuf = MALLOC(double, k * W), *mbuf = MALLOC(double, k * k * MEDNET_TILE);
+		double *colw[2*MEDNET_MAXRADIUS + 1], *mw[(2*MEDNET_MAXRADIUS + 1)*(2*MEDNET_MAXRADIUS + 1)], *cw[MEDNET_MAXPAIRS];
+		for(size_t i = 0; i < k; ++i) colw[i] = &colbuf[i * W];
+		for(size_t i = 0; i < k*k; ++i) mw[i] = &mbuf[i * MEDNET_TILE];
+		for(int i = 0; i < ncand; ++i) cw[i] = mw[cand[i]];
+		const double *top = &inputima[(y - radius) * w];
+		for(size_t xs = radius; xs < w - radius; xs += MEDNET_TILE){
+			size_t T = MIN(MEDNET_TILE, w - radius - xs), TW = T + 2*radius;
+			// sort columns
+			for(size_t i = 0; i < k; ++i) memcpy(colw[i], &top[i * w + xs - radius], TW * sizeof(double));
+			sort_wires(colw, &colnet, TW);
+			// window rows: mw[i*k + j][l] is element of row i, column j of window for pixel xs + l
+			for(size_t i = 0; i < k; ++i){
+				for(size_t j = 0; j < k; ++j) memcpy(mw[i*k + j], &colw[i][j], T * sizeof(double));
+				sort_wires(&mw[i*k], &colnet, T);
+			}
+			sort_wires(cw, &candnet, T);
+			memcpy(&med[y * w + xs], cw[rank], T * sizeof(double));
+		}
+		FREE(colbuf); FREE(mbuf);
+	}
+}
+
+/**
+ * @brief get_median_cross - median filter by cross 3x3
+ * We have 5 datapoints and 4 inserts @ each step, so it's better to use opt_med5 network instead of Mediator
+ * Only inner part of image is filtered, borders are processed by median_borders()
+ * @param img (i) - input image
+ * @param out (o) - output image (allocated outside)
+ */
+static void get_median_cross(const doubleimage *img, doubleimage *out){
 #ifdef EBUG
 	double t0 = dtime();
 #endif
-	OMP_FOR()
-	for(size_t x = 1; x < w - 1; ++x){
-		double buffer[5];
-		size_t curpix = x + w, // index of current pixel image arrays
-			y, ymax = h - 1;
-		for(y = 1; y < ymax; ++y, curpix += w){
-			double md, *I = &inputima[curpix]; //, Ival = *I;
-			memcpy(buffer, I - 1, 3*sizeof(double));
-			buffer[3] = I[-w]; buffer[4] = I[w];
-			md = opt_med5(buffer);
-            /*
-			if(adp){
-				double s, l;
-				s = DBL_EPSILON + MIN(buffer[0], buffer[1]);
-				l = MAX(buffer[3], buffer[4]) - DBL_EPSILON;
-				if(s < md && md < l){
-					if(s < Ival && Ival < l) med[curpix] = Ival;
-					else med[curpix] = md;
-				}else{
-					med[curpix] = adp_med_5by5(img, x, y);
+	mednet_cross(img, out);
+	DBG("time for median filtering by cross 3x3 of image %zdx%zd: %gs", img->width, img->height,
+		dtime() - t0);
+}
+
+/**
+ * @brief mkborder_map - make map of coordinates for extended (by `r` pixels from each side) axis
+ * @param n    - axis length
+ * @param r    - extension
+ * @param mode - border mode
+ * @return array of length `n + 2r`: map[i + r] is coordinate on real axis for coordinate `i`
+ *      or -1 if there's no pixel with given coordinate (for BORDER_CONSTANT and BORDER_SHRINK)
+ */
+static ssize_t *mkborder_map(size_t n, size_t r, border_mode mode){
+	ssize_t N = (ssize_t)n, R = (ssize_t)r;
+	ssize_t *map = MALLOC(ssize_t, n + 2*r);
+	for(ssize_t i = -R; i < N + R; ++i){
+		ssize_t j = i;
+		if(i < 0 || i >= N) switch(mode){
+			case BORDER_REFLECT: // ...cba|abc...
+				j = (i < 0) ? -i - 1 : 2*N - i - 1;
+				if(j < 0) j = 0; // window is larger than image
+				else if(j >= N) j = N - 1;
+			break;
+			case BORDER_REPLICATE: // ...aaa|abc...
+				j = (i < 0) ? 0 : N - 1;
+			break;
+			default: // constant or shrinked window
+				j = -1;
+		}
+		map[i + R] = j;
+	}
+	return map;
+}
+
+/**
+ * @brief border_median - median of window around border pixel
+ * @param img (i)  - input image
+ * @param x, y     - pixel coordinates
+ * @param radius   - window radius (0 for cross 3x3)
+ * @param xmap (i) - map of x coordinates (from mkborder_map with r == MAX(radius, 1))
+ * @param ymap (i) - map of y coordinates
+ * @param cval     - value of pixels outside image for BORDER_CONSTANT
+ * @param buf      - buffer for window values
+ * @return median value (for even amount of pixels - mean of two middle values, like Mediator gives)
+ */
+static double border_median(const doubleimage *img, size_t x, size_t y, size_t radius,
+							const ssize_t *xmap, const ssize_t *ymap, double cval, border_mode mode, double *buf){
+	size_t w = img->width, n = 0;
+	const double *inputima = img->data;
+	// add pixel with extended coordinates (xe, ye) into buffer
+	#define ADDPIX(xe, ye)  do{ssize_t X = xmap[xe], Y = ymap[ye]; \
+		if(X > -1 && Y > -1) buf[n++] = inputima[X + Y*w]; \
+		else if(mode == BORDER_CONSTANT) buf[n++] = cval;}while(0)
+	if(radius == 0){ // cross 3x3; x + 1 and y + 1 are coordinates of current pixel in maps
+		ADDPIX(x + 1, y + 1);
+		ADDPIX(x, y + 1); ADDPIX(x + 2, y + 1);
+		ADDPIX(x + 1, y); ADDPIX(x + 1, y + 2);
+	}else{
+		size_t blksz = 2*radius + 1;
+		for(size_t yy = y; yy < y + blksz; ++yy)
+			for(size_t xx = x; xx < x + blksz; ++xx) ADDPIX(xx, yy);
+	}
+	#undef ADDPIX
+	if(n & 1) return calc_median_buf(buf, n, buf);
+	const size_t k[2] = {n/2 - 1, n/2};
+	dbl_multiselect(buf, n, k, 2);
+	return (buf[k[0]] + buf[k[1]]) / 2.;
+}
+
+/**
+ * @brief border_line - median filtering of one border row or column by sliding window
+ *      Window slides along line as in median_inner(): Mediator is a circular queue and each
+ *      new line of window (column for rows, row for columns) replaces the oldest one. For
+ *      BORDER_SHRINK amount of pixels in all lines of window should be the same along [s0, s1)
+ * @param img (i)  - input image
+ * @param med (o)  - output data
+ * @param c        - coordinate of line (y for row, x for column)
+ * @param s0, s1   - range of coordinates along line
+ * @param vertical - TRUE for column
+ * @param radius   - window radius (> 0)
+ * @param xmap (i) - map of x coordinates (from mkborder_map with r == radius)
+ * @param ymap (i) - map of y coordinates
+ * @param mode     - border mode
+ * @param cval     - value of pixels outside image for BORDER_CONSTANT
+ * @param m        - Mediator with place for at least (2*radius+1)^2 values
+ */
+static void border_line(const doubleimage *img, double *med, size_t c, size_t s0, size_t s1, bool vertical,
+						size_t radius, const ssize_t *xmap, const ssize_t *ymap, border_mode mode, double cval, Mediator *m){
+	if(s0 >= s1) return;
+	size_t w = img->width, blksz = 2*radius + 1, nv = 0;
+	const double *inputima = img->data;
+	// maps along line and across it; extended coordinate `s` is beginning of window with center `s - radius`
+	const ssize_t *smap = vertical ? ymap : xmap, *cmap = vertical ? xmap : ymap;
+	size_t sstep = vertical ? w : 1, cstep = vertical ? 1 : w;
+	for(size_t i = c; i < c + blksz; ++i) if(cmap[i] > -1 || mode != BORDER_SHRINK) ++nv;
+	MediatorInit(m, (int)(nv * blksz));
+	// insert line `se` (extended coordinate) of window
+	#define INSLINE(se)  do{ssize_t S = smap[se]; for(size_t i = c; i < c + blksz; ++i){ 		ssize_t C = cmap[i]; 		if(S > -1 && C > -1) MediatorInsert(m, inputima[S*sstep + C*cstep]); 		else if(mode == BORDER_CONSTANT) MediatorInsert(m, cval);}}while(0)
+	for(size_t s = s0; s < s0 + 2*radius; ++s) INSLINE(s);
+	for(size_t s = s0; s < s1; ++s){
+		INSLINE(s + 2*radius);
+		med[s*sstep + c*cstep] = MediatorMedian(m);
+	}
+	#undef INSLINE
+}
+
+/**
+ * @brief median_borders - median filtering of image borders
+ *      Full rows near top and bottom and columns near left and right edges are processed
+ *      by sliding window (border_line()); only cross 3x3 and corners for BORDER_SHRINK
+ *      (where window size changes along line) are processed pixel by pixel
+ * @param img (i)  - input image
+ * @param out (o)  - output image
+ * @param radius   - window radius (0 for cross 3x3)
+ * @param mode     - border mode
+ * @param cval     - value of pixels outside image for BORDER_CONSTANT
+ */
+static void median_borders(const doubleimage *img, doubleimage *out, size_t radius, border_mode mode, double cval){
+	size_t w = img->width, h = img->height, r = MAX(radius, 1);
+	size_t blksz = radius * 2 + 1, fullsz = MAX(blksz * blksz, 5);
+	ssize_t *xmap = mkborder_map(w, r, mode), *ymap = mkborder_map(h, r, mode);
+	// top rows [0, yt) and bottom rows [yb, h) are processed fully
+	size_t yt = MIN(r, h), yb = MAX((h > r) ? h - r : 0, yt);
+	// in middle rows process columns [0, xl) and [xr, w)
+	size_t xl = MIN(r, w), xr = MAX((w > r) ? w - r : 0, xl);
+	// lines to process: top and bottom rows, then left and right columns
+	size_t nrows = yt + h - yb, nlines = nrows + ((yb > yt) ? xl + w - xr : 0);
+	double *med = out->data;
+#ifdef EBUG
+	double t0 = dtime();
+#endif
+	OMP_FOR(schedule(dynamic))
+	for(size_t l = 0; l < nlines; ++l){
+		double *buf = MALLOC(double, fullsz);
+		Mediator *m = radius ? MediatorNew(fullsz) : NULL;
+		if(l < nrows){ // full row
+			size_t y = (l < yt) ? l : yb + l - yt, x = 0, idx = y * w;
+			if(radius && mode != BORDER_SHRINK) border_line(img, med, y, 0, w, FALSE, radius, xmap, ymap, mode, cval, m);
+			else{
+				for(; x < xl; ++x)
+					med[idx + x] = border_median(img, x, y, radius, xmap, ymap, cval, mode, buf);
+				if(radius){
+					border_line(img, med, y, xl, xr, FALSE, radius, xmap, ymap, mode, cval, m);
+					x = xr;
 				}
-			}else */
-				med[curpix] = md;
+				for(; x < w; ++x)
+					med[idx + x] = border_median(img, x, y, radius, xmap, ymap, cval, mode, buf);
+			}
+		}else{ // column of middle rows
+			size_t x = l - nrows;
+			if(x >= xl) x += xr - xl;
+			if(radius) border_line(img, med, x, yt, yb, TRUE, radius, xmap, ymap, mode, cval, m);
+			else for(size_t y = yt; y < yb; ++y)
+				med[y*w + x] = border_median(img, x, y, radius, xmap, ymap, cval, mode, buf);
 		}
+		FREE(m);
+		FREE(buf);
 	}
-	// process borders & corners (without adaptive)
-	double buf[5];
-	// left top
-	buf[0] = inputima[0]; buf[1] = inputima[0];
-	buf[2] = inputima[1]; buf[3] = inputima[w];
-	buf[4] = inputima[w + 1];
-	med[0] = opt_med5(buf);
-	// right top
-	iptr = &inputima[w - 1];
-	buf[0] = iptr[0]; buf[1] = iptr[0];
-	buf[2] = iptr[-1]; buf[3] = iptr[w - 1];
-	buf[4] = iptr[w];
-	med[w - 1] = opt_med5(buf);
-	// left bottom
-	iptr = &inputima[(h - 1) * w];
-	buf[0] = iptr[0]; buf[1] = iptr[0];
-	buf[2] = iptr[-w]; buf[3] = iptr[1 - w];
-	buf[4] = iptr[1];
-	med[(h - 1) * w] = opt_med5(buf);
-	// right bottom
-	iptr = &inputima[h * w - 1];
-	buf[0] = iptr[0]; buf[1] = iptr[0];
-	buf[2] = iptr[-w-1]; buf[3] = iptr[-w];
-	buf[4] = iptr[-1];
-	med[h * w - 1] = opt_med5(buf);
-	// process borders without corners
-	// top
-	OMP_FOR(shared(med))
-	for(size_t x = 1; x < w - 1; ++x){
-		double *iptr = &inputima[x];
-		buf[0] = buf[1] = *iptr;
-		buf[2] = iptr[-1]; buf[3] = iptr[2];
-		buf[4] = iptr[w];
-		med[x] = opt_med5(buf);
-	}
-	// bottom
-	size_t curidx = (h-2)*w;
-	OMP_FOR(shared(curidx, med))
-	for(size_t x = 1; x < w - 1; --x){
-		double *iptr = &inputima[curidx + x];
-		buf[0] = buf[1] = *iptr;
-		buf[2] = iptr[-w]; buf[3] = iptr[-1];
-		buf[4] = iptr[1];
-		med[curidx + x] = opt_med5(buf);
-	}
-	// left
-	OMP_FOR(shared(med))
-	for(size_t y = 1; y < h - 1; ++y){
-		size_t cur = y * w;
-		double *iptr = &inputima[cur];
-		buf[0] = buf[1] = *iptr;
-		buf[2] = iptr[-w]; buf[3] = iptr[1];
-		buf[4] = iptr[w];
-		med[cur] = opt_med5(buf);
-	}
-	// right
-	curidx = w - 1;
-	OMP_FOR(shared(curidx, med))
-	for(size_t y = 1; y < h - 1; ++y){
-		size_t cur = curidx + y * w;
-		double *iptr = &inputima[cur];
-		buf[0] = buf[1] = *iptr;
-		buf[2] = iptr[-w]; buf[3] = iptr[-1];
-		buf[4] = iptr[w];
-		med[cur] = opt_med5(buf);
-	}
-	DBG("time for median filtering by cross 3x3 of image %zdx%zd: %gs", w, h,
-		dtime() - t0);
+	FREE(xmap); FREE(ymap);
+	DBG("time for borders median filtering of image %zdx%zd: %gs", w, h, dtime() - t0);
 }
 
-// TODO: add borders and corners
 /**
- * @brief get_median - filter image by median (radius*2 + 1) x (radius*2 + 1)
+ * @brief median_inner - median filtering of inner part of image (without `radius` pixels near borders)
+ *      Each thread processes its own horizontal stripe by tiles of cache size; window slides
+ *      along rows: Mediator is a circular queue, so inserting of new column replaces the oldest
+ *      (leftmost) one. The same Mediator is used for all rows of stripe: after filling of
+ *      `blksz` columns at the beginning of each row all its old values are replaced.
  * @param img (i) - input image
- * @param radius  - zone radius (0 for cross 3x3)
- * @return image filtered by median (allocated here)
+ * @param out (o) - output image
+ * @param radius  - window radius (> 0)
  */
-doubleimage *get_median(const doubleimage *img, size_t radius){
+static void median_inner(const doubleimage *img, doubleimage *out, size_t radius){
 	size_t w = img->width, h = img->height;
-    doubleimage *out = doubleimage_new(img->width, img->height);
-    if(!out){
-        WARNX(_("Can't create output image"));
-        return NULL;
-    }
-    memcpy(out->data, img->data, sizeof(double)*img->totpix);
-	double *med = out->data, *inputima = img->data;
-	if(radius == 0){
-		get_adp_median_cross(img, out, 0);
-		return out;
-	}
-
 	size_t blksz = radius * 2 + 1, fullsz = blksz * blksz;
+	if(w < blksz || h < blksz) return; // there's no inner part
+	double *med = out->data, *inputima = img->data;
+	size_t xmax = w - radius, ymax = h - radius, nrows = ymax - radius;
+	// width of tile: `blksz` rows of tile should fit cache
+	size_t tilew = MAX(MEDIAN_CACHESZ / (blksz * sizeof(double)), blksz);
+	size_t nstripes = omp_get_max_threads();
+	if(nstripes > nrows) nstripes = nrows;
+	size_t stripeh = (nrows + nstripes - 1) / nstripes;
 #ifdef EBUG
 	double t0 = dtime();
 #endif
-	OMP_FOR(shared(inputima, med))
-	for(size_t x = radius; x < w - radius; ++x){
-		size_t xx, yy, xm = x + radius + 1, y, ymax = blksz - 1, xmin = x - radius;
+	OMP_FOR()
+	for(size_t s = 0; s < nstripes; ++s){
+		size_t ys = radius + s * stripeh, ye = MIN(ys + stripeh, ymax);
 		Mediator* m = MediatorNew(fullsz);
-		// initial fill
-		for(yy = 0; yy < ymax; ++yy)
-			for(xx = xmin; xx < xm; ++xx)
-				MediatorInsert(m, inputima[xx + yy*w]);
-		ymax = 2*radius*w;
-		xmin += ymax;
-		xm += ymax;
-		ymax = h - radius;
-		size_t medidx = x + radius * w;
-		for(y = radius; y < ymax; ++y, xmin += w, xm += w, medidx += w){
-			for(xx = xmin; xx < xm; ++xx)
-				MediatorInsert(m, inputima[xx]);
-			med[medidx] = MediatorMedian(m);
+		for(size_t xs = radius; xs < xmax; xs += tilew){
+			size_t xe = MIN(xs + tilew, xmax);
+			for(size_t y = ys; y < ye; ++y){
+				const double *top = &inputima[(y - radius) * w]; // upper row of window
+				double *o = &med[y * w];
+				// insert column `x` of window into Mediator
+				#define INSCOL(x)  do{const double *p = &top[x]; \
+					for(size_t i = 0; i < blksz; ++i, p += w) MediatorInsert(m, *p);}while(0)
+				for(size_t x = xs - radius; x < xs + radius; ++x) INSCOL(x);
+				for(size_t x = xs; x < xe; ++x){
+					INSCOL(x + radius);
+					o[x] = MediatorMedian(m);
+				}
+				#undef INSCOL
+			}
 		}
 		FREE(m);
 	}
 	DBG("time for median filtering %zdx%zd of image %zdx%zd: %gs", blksz, blksz, w, h,
 		dtime() - t0);
+}
+
+/**
+ * @brief get_median_border - filter image by median (radius*2 + 1) x (radius*2 + 1)
+ *      with given type of border processing
+ * @param img (i) - input image
+ * @param radius  - zone radius (0 for cross 3x3)
+ * @param mode    - how to process pixels near borders:
+ *                  BORDER_NONE - leave them unfiltered
+ *                  BORDER_REFLECT - mirror image relative to its edge (...cba|abc...)
+ *                  BORDER_REPLICATE - repeat edge pixels (...aaa|abc...)
+ *                  BORDER_CONSTANT - pixels outside image are equal to `cval`
+ *                  BORDER_SHRINK - use only pixels inside image (window is smaller near borders,
+ *                      median of even amount of pixels is mean of two middle values)
+ * @param cval    - value for BORDER_CONSTANT
+ * @return image filtered by median (allocated here) or NULL if failed
+ */
+doubleimage *get_median_border(const doubleimage *img, size_t radius, border_mode mode, double cval){
+	if(!img || !img->data || img->totpix < 1) return NULL;
+	if(mode < BORDER_NONE || mode >= BORDER_COUNT){
+		WARNX(_("Wrong border mode"));
+		return NULL;
+	}
+	doubleimage *out = doubleimage_new(img->width, img->height);
+	if(!out){
+		WARNX(_("Can't create output image"));
+		return NULL;
+	}
+	if(mode == BORDER_NONE) memcpy(out->data, img->data, sizeof(double)*img->totpix);
+	if(radius == 0) get_median_cross(img, out);
+	else if(radius <= MEDNET_MAXRADIUS){
+#ifdef EBUG
+		double t0 = dtime();
+#endif
+		mednet_inner(img, out, radius);
+		DBG("time for median filtering %zdx%zd of image %zdx%zd by sorting network: %gs", 2*radius+1,
+			2*radius+1, img->width, img->height, dtime() - t0);
+	}else median_inner(img, out, radius);
+	if(mode != BORDER_NONE) median_borders(img, out, radius, mode, cval);
 	return out;
 }
 
-#if 0
+/**
+ * @brief get_median - filter image by median (radius*2 + 1) x (radius*2 + 1)
+ *      image borders are reflected, use get_median_border() for other variants
+ * @param img (i) - input image
+ * @param radius  - zone radius (0 for cross 3x3)
+ * @return image filtered by median (allocated here)
+ */
+doubleimage *get_median(const doubleimage *img, size_t radius){
+	return get_median_border(img, radius, BORDER_REFLECT, 0.);
+}
 
 /**
- * procedure for finding median value in window 5x5
- * PROBLEM: bounds
+ * @brief adp_grow - adaptive median of one pixel by growing window
+ * @param img (i)  - input image
+ * @param x, y     - pixel coordinates
+ * @param r0       - starting window radius (0 for cross 3x3, next window would be square 3x3)
+ * @param rmax     - largest window radius
+ * @param xmap (i) - map of x coordinates (from mkborder_map with r == R)
+ * @param ymap (i) - map of y coordinates
+ * @param R        - extension of maps
+ * @param buf      - buffer for window values (at least (2*rmax+1)^2 elements)
+ * @return new pixel value: pixel itself if it isn't an outlier, median of first window with
+ *      median that is not an impulse, or pixel value if there's no such window
  */
-static double adp_med_5by5(const IMAGE *img, size_t x, size_t y){
-	size_t blocklen, w = img->width, h = img->height, yy, _2w = 2 * w;
-	double arr[25], *arrptr = arr, *dataptr, *currpix;
-	int position = ((x < 1) ? 1 : 0)        // left columns
-				 + ((x > w - 2) ? 2 : 0)    // right columns
-				 + ((y < 1) ? 4 : 0)        // top rows
-				 + ((y > w - 2) ? 8 : 0);   // bottom rows
-	/* Now by value of "position" we know where is the point:
-	 ***************************
-	 * 5 *        4        * 6 *
-	 ***************************
-	 *   *                 *   *
-	 *   *                 *   *
-	 * 1 *        0        * 2 *
-	 *   *                 *   *
-	 *   *                 *   *
-	 ***************************
-	 * 9 *        8        *10 *
-	 ***************************/
-	currpix = &img->data[x + y * w]; // pointer to current pixel
-	dataptr = currpix - _2w - 2;     // pointer to left upper corner of 5x5 square
-	inline void copy5times(double val){
-		for(int i = 0; i < 5; ++i) *arrptr++ = val;
-	}
-	inline void copy9times(double val){
-		for(int i = 0; i < 9; ++i) *arrptr++ = val;
-	}
-	void copycolumn(double *startpix){
-		for(int i = 0; i < 5; ++i, startpix += w) *arrptr++ = *startpix;
-	}
-	inline void copyvertblock(size_t len){
-		for(int i = 0; i < 5; ++i, dataptr += w, arrptr += len)
-			memcpy(arrptr, dataptr, len * sizeof(double));
-	}
-	inline void copyhorblock(size_t len){
-		for(size_t i = 0; i < len; ++i, dataptr += w, arrptr += 5)
-			memcpy(arrptr, dataptr, 5 * sizeof(double));
-	}
-	inline void copyblock(){
-		for(size_t i = 0; i < 4; ++i, dataptr += w, arrptr += 4)
-			memcpy(arrptr, dataptr, 4 * sizeof(double));
-	}
-	switch(position){
-		case 1: // left
-			copy5times(*currpix); // make 5 copies of current pixel
-			if(x == 0){ // copy 1st column too
-				dataptr += 2;
-				copycolumn(dataptr);
-				blocklen = 3;
-			}else{ // 2nd column - no copy need
-				++dataptr;
-				blocklen = 4;
+static double adp_grow(const doubleimage *img, size_t x, size_t y, size_t r0, size_t rmax,
+						const ssize_t *xmap, const ssize_t *ymap, size_t R, double *buf){
+	size_t w = img->width;
+	double z = img->data[x + y*w];
+	for(size_t r = r0; r <= rmax; ++r){
+		size_t n = 0;
+		double zmin = z, zmax = z;
+		if(r == 0){ // cross 3x3: central row and central column
+			const ssize_t X = xmap[x + R], Y = ymap[y + R];
+			buf[0] = z;
+			buf[1] = img->data[xmap[x + R - 1] + Y*w];
+			buf[2] = img->data[xmap[x + R + 1] + Y*w];
+			buf[3] = img->data[X + ymap[y + R - 1]*w];
+			buf[4] = img->data[X + ymap[y + R + 1]*w];
+			for(n = 1; n < 5; ++n){
+				if(buf[n] < zmin) zmin = buf[n];
+				else if(buf[n] > zmax) zmax = buf[n];
 			}
-			copyvertblock(blocklen);
-		break;
-		case 2: // right
-			copy5times(*currpix);
-			if(x == w - 1){ // copy last column too
-				copycolumn(dataptr + 2);
-				blocklen = 3;
-			}else{ // 2nd column - no copy need
-				blocklen = 4;
+		}else for(size_t ye = y + R - r; ye <= y + R + r; ++ye){
+			const double *row = &img->data[ymap[ye] * w];
+			for(size_t xe = x + R - r; xe <= x + R + r; ++xe){
+				double v = row[xmap[xe]];
+				if(v < zmin) zmin = v;
+				else if(v > zmax) zmax = v;
+				buf[n++] = v;
 			}
-			copyvertblock(blocklen);
-		break;
-		case 4: // top
-			copy5times(*currpix);
-			if(y == 0){
-				dataptr += _2w;
-				memcpy(arrptr, dataptr, 5 * sizeof(double));
-				blocklen = 3;
-			}else{
-				dataptr += w;
-				blocklen = 4;
+		}
+		double zmed = dbl_select(buf, n, n / 2);
+		if(zmin < zmed && zmed < zmax) return (zmin < z && z < zmax) ? z : zmed;
+	}
+	return z;
+}
+
+/**
+ * @brief get_adaptive_median - adaptive median filter (for impulse noise removal)
+ * Pixel is replaced by median only if it is minimal or maximal value in window; if median itself
+ * is extremal value, window grows up to LARGEST_ADPMED_RADIUS. Medians of starting window are
+ * calculated for whole image by regular filter, so only noisy pixels (and borders) are processed
+ * by slow per-pixel procedure. Borders are processed as BORDER_REFLECT.
+ * @param img (i) - input image
+ * @param radius  - radius of starting window (0 for cross 3x3)
+ * @return filtered image or NULL if failed
+ */
+doubleimage *get_adaptive_median(const doubleimage *img, size_t radius){
+	if(!img || !img->data || img->totpix < 1) return NULL;
+#ifdef EBUG
+	double t0 = dtime();
+#endif
+	// medians of starting window for inner pixels, borders are copied from `img`
+	doubleimage *out = get_median_border(img, radius, BORDER_NONE, 0.);
+	if(!out) return NULL;
+	size_t w = img->width, h = img->height, r = MAX(radius, 1), rmax = MAX(radius, LARGEST_ADPMED_RADIUS);
+	ssize_t *xmap = mkborder_map(w, rmax, BORDER_REFLECT), *ymap = mkborder_map(h, rmax, BORDER_REFLECT);
+	const double *inputima = img->data;
+	double *med = out->data;
+	size_t ngrow = 0;
+	OMP_FOR(reduction(+:ngrow))
+	for(size_t y = 0; y < h; ++y){
+		double *buf = MALLOC(double, (2*rmax + 1) * (2*rmax + 1));
+		double *mn = NULL, *mx = NULL;
+		const double *I = &inputima[y * w];
+		double *O = &med[y * w];
+		bool inner = (y >= r && y < h - r && w > 2*r);
+		if(inner){ // min/max of starting window
+			mn = MALLOC(double, 4*w);
+			mx = mn + w;
+			double *cmn = mx + w, *cmx = cmn + w; // min/max by columns
+			size_t ystart = y - radius, yend = y + radius;
+			if(radius == 0){ ystart = y - 1; yend = y + 1; }
+			memcpy(cmn, &inputima[ystart * w], w * sizeof(double));
+			memcpy(cmx, cmn, w * sizeof(double));
+			for(size_t yy = ystart + 1; yy <= yend; ++yy){
+				const double *row = &inputima[yy * w];
+				OMP_SIMD()
+				for(size_t x = 0; x < w; ++x){
+					cmn[x] = MIN(cmn[x], row[x]);
+					cmx[x] = MAX(cmx[x], row[x]);
+				}
+			}
+			const double *hmn = cmn, *hmx = cmx; // sources for horizontal pass
+			if(radius == 0) hmn = hmx = I; // cross: only central row
+			memcpy(mn, cmn, w * sizeof(double));
+			memcpy(mx, cmx, w * sizeof(double));
+			for(size_t dx = 1; dx <= r; ++dx){
+				OMP_SIMD()
+				for(size_t x = r; x < w - r; ++x){
+					mn[x] = MIN(mn[x], MIN(hmn[x - dx], hmn[x + dx]));
+					mx[x] = MAX(mx[x], MAX(hmx[x - dx], hmx[x + dx]));
+				}
+			}
+		}
+		for(size_t x = 0; x < w; ++x){
+			if(!inner || x < r || x >= w - r){
+				O[x] = adp_grow(img, x, y, radius, rmax, xmap, ymap, rmax, buf);
+				continue;
 			}
-			copyhorblock(blocklen);
-		break;
-		case 8: // bottom
-			copy5times(*currpix);
-			if(y == h - 1){
-				memcpy(arrptr, dataptr + _2w, 5 * sizeof(double));
-				blocklen = 3;
-			}else{
-				blocklen = 4;
+			double z = I[x], zmed = O[x], zmin = mn[x], zmax = mx[x];
+			if(zmin < zmed && zmed < zmax) O[x] = (zmin < z && z < zmax) ? z : zmed;
+			else{
+				O[x] = adp_grow(img, x, y, radius + 1, rmax, xmap, ymap, rmax, buf);
+				++ngrow;
 			}
-			copyhorblock(blocklen);
-		break;
-		case 5: // top left corner: in all corners we just copy 4x4 square & 9 times this pixel
-			copy9times(*currpix);
-			dataptr = img->data;
-			copyblock();
-		break;
-		case 6: // top right corner
-			copy9times(*currpix);
-			dataptr = &img->data[w - 4];
-			copyblock();
-		break;
-		case 9: // bottom left cornet
-			copy9times(*currpix);
-			dataptr = &img->data[(y - 4) * w];
-			copyblock();
-		break;
-		case 10: // bottom right cornet
-			copy9times(*currpix);
-			dataptr = &img->data[(y - 3) * w - 4];
-			copyblock();
-		break;
-		default:  // 0
-			for(yy = 0; yy < 5; ++yy, dataptr += w, arrptr += 5)
-				memcpy(arrptr, dataptr, 5*sizeof(double));
-	}
-	return opt_med25(arr);
+		}
+		FREE(mn);
+		FREE(buf);
+	}
+	FREE(xmap); FREE(ymap);
+	DBG("time for adaptive median filtering %zdx%zd of image %zdx%zd (%zd windows grown): %gs",
+		2*radius + 1, 2*radius + 1, w, h, ngrow, dtime() - t0);
+	return out;
 }
 
+/*
+ * Constant-time median filter for integer images
+ * S. Perreault and P. Hebert, "Median Filtering in Constant Time",
+ * IEEE Transactions on Image Processing, 16(9), 2007
+ * Image is processed by vertical stripes; each stripe holds histograms of its columns
+ * (height of column = window height), kernel histogram slides along row by adding
+ * and removing of column histograms. Histograms are two-level: coarse level is used
+ * to find part of fine histogram with median, fine parts of kernel histogram are
+ * updated lazily (only when median falls into them).
+ */
+
+// max radius of integer median filter (column histogram counters are uint8_t)
+#define MEDINT_MAXRADIUS    (127)
+// histograms are scanned by blocks of this size
+#define MEDINT_SCANBLK      (16)
+// memory for column histograms of one stripe
+#define MEDINT_MEMBUDGET    (1<<23)
+// max/min width of one stripe
+#define MEDINT_MAXSTRIPE    (512)
+#define MEDINT_MINSTRIPE    (16)
+
+// parameters of histograms
+typedef struct{
+	size_t radius;          // filter radius
+	size_t w, h;            // image size
+	int coarsebits;         // coarse histogram size is 1<<coarsebits
+	int finebits;           // each part of fine histogram has size 1<<finebits
+	size_t NC, NF, NB;      // coarse size, size of fine parts and total amount of bins
+	const uint16_t *vals;   // image values (minus minimal value)
+	const ssize_t *xmap;    // map of x coordinates (see mkborder_map)
+	const ssize_t *ymap;    // map of y coordinates
+	border_mode mode;       // border mode
+	uint16_t cval;          // constant for BORDER_CONSTANT
+} medint_pars;
+
+// add (`sign` == 1) or remove (`sign` == -1) extended row `i` to column histograms
+static void medint_row(const medint_pars *p, size_t xs, size_t n, ssize_t i, int sign,
+					   uint8_t *cfine, uint8_t *ccoarse, uint8_t *ccnt){
+	ssize_t Y = p->ymap[i + (ssize_t)p->radius];
+	const uint16_t *row = (Y > -1) ? &p->vals[Y * p->w] : NULL;
+	for(size_t c = 0; c < n; ++c){
+		ssize_t X = p->xmap[xs + c];
+		uint16_t v;
+		if(row && X > -1) v = row[X];
+		else if(p->mode == BORDER_CONSTANT) v = p->cval;
+		else continue; // shrinked window
+		cfine[c * p->NB + v] += sign;
+		ccoarse[c * p->NC + (v >> p->finebits)] += sign;
+		ccnt[c] += sign;
+	}
+}
 
 /**
- * filter image by median (radius*2 + 1) x (radius*2 + 1)
+ * @brief medint_scan - find bin of histogram where cumulative sum exceeds `t`
+ * @param H     - histogram
+ * @param N     - its size (power of 2)
+ * @param t     - rank of value to find
+ * @param sum   - (io) sum of all bins below H[0], at return - sum of all bins below found
+ * @return index of bin found
  */
-doubleimage *get_adaptive_median(const doubleimage *img, size_t radius);{
-	int radius = f->w;
-	size_t w = img->width, h = img->height, siz = w*h, bufsiz = siz*sizeof(double);
-	IMAGE *out = similarFITS(img, img->dtype);
-	double *med = out->data, *inputima = img->data;
-	memcpy(med, inputima, bufsiz);
-	if(radius == 0){
-		get_adp_median_cross(img, out, 1);
-		return out;
+static inline size_t medint_scan(const uint16_t *H, size_t N, size_t t, size_t *sum){
+	size_t k = 0, s = *sum;
+	if(N >= MEDINT_SCANBLK) for(; k < N - MEDINT_SCANBLK; k += MEDINT_SCANBLK){
+		size_t sb = 0; // sum of block (vectorized)
+		OMP_SIMD(reduction(+:sb))
+		for(int i = 0; i < MEDINT_SCANBLK; ++i) sb += H[k + i];
+		if(s + sb > t) break;
+		s += sb;
 	}
-	size_t blksz = radius * 2 + 1, fullsz = blksz * blksz;
+	for(; k < N - 1; ++k){
+		if(s + H[k] > t) break;
+		s += H[k];
+	}
+	*sum = s;
+	return k;
+}
+
+// process one stripe [xs, xe) of image
+static void medint_stripe(const medint_pars *p, size_t xs, size_t xe, uint16_t *out){
+	size_t r = p->radius, d = 2*r + 1, n = xe - xs + 2*r, NC = p->NC, NF = p->NF, NB = p->NB;
+	uint8_t *cfine = MALLOC(uint8_t, n * NB), *ccoarse = MALLOC(uint8_t, n * NC), *ccnt = MALLOC(uint8_t, n);
+	uint16_t *Hf = MALLOC(uint16_t, NB), *Hc = MALLOC(uint16_t, NC);
+	size_t *luc = MALLOC(size_t, NC);
+	ssize_t R = (ssize_t)r;
+	for(ssize_t i = -R; i < R; ++i) medint_row(p, xs, n, i, 1, cfine, ccoarse, ccnt);
+	for(size_t y = 0; y < p->h; ++y){
+		ssize_t Y = (ssize_t)y;
+		medint_row(p, xs, n, Y + R, 1, cfine, ccoarse, ccnt);
+		if(y) medint_row(p, xs, n, Y - R - 1, -1, cfine, ccoarse, ccnt);
+		// kernel histogram for first pixel of stripe
+		memset(Hc, 0, NC * sizeof(uint16_t));
+		memset(luc, 0, NC * sizeof(size_t));
+		size_t cnt = 0;
+		for(size_t c = 0; c < d; ++c){
+			const uint8_t *cc = &ccoarse[c * NC];
+			OMP_SIMD()
+			for(size_t k = 0; k < NC; ++k) Hc[k] += cc[k];
+			cnt += ccnt[c];
+		}
+		uint16_t *o = &out[y * p->w + xs];
+		for(size_t j = 0; j < xe - xs; ++j){
+			if(j){ // slide window: add column j+2r, remove column j-1
+				const uint8_t *ca = &ccoarse[(j + 2*r) * NC], *cr = &ccoarse[(j - 1) * NC];
+				OMP_SIMD()
+				for(size_t k = 0; k < NC; ++k) Hc[k] += ca[k] - cr[k];
+				cnt += ccnt[j + 2*r] - ccnt[j - 1];
+			}
+			size_t t = (cnt - 1) / 2, sum = 0;
+			size_t k = medint_scan(Hc, NC, t, &sum); // coarse bin with median
+			// update fine part `k` of kernel histogram
+			uint16_t *hf = &Hf[k * NF];
+			if(luc[k] <= j){ // too old - recalculate
+				memset(hf, 0, NF * sizeof(uint16_t));
+				for(size_t c = j; c < j + d; ++c){
+					const uint8_t *cf = &cfine[c * NB + k * NF];
+					OMP_SIMD()
+					for(size_t f = 0; f < NF; ++f) hf[f] += cf[f];
+				}
+			}else for(size_t c = luc[k]; c < j + d; ++c){
+				const uint8_t *ca = &cfine[c * NB + k * NF], *cr = &cfine[(c - d) * NB + k * NF];
+				OMP_SIMD()
+				for(size_t f = 0; f < NF; ++f) hf[f] += ca[f] - cr[f];
+			}
+			luc[k] = j + d;
+			size_t f = medint_scan(hf, NF, t, &sum);
+			o[j] = (uint16_t)(k * NF + f);
+		}
+	}
+	FREE(cfine); FREE(ccoarse); FREE(ccnt); FREE(Hf); FREE(Hc); FREE(luc);
+}
+
+/**
+ * @brief get_median_int - median filtering of integer (8 or 16 bit) image in constant time per pixel
+ *      (Perreault & Hebert algorithm); time of filtering almost independent on radius
+ *      for windows with even amount of pixels (BORDER_SHRINK) lower median is used
+ * @param img (i) - 2-dimensional image of type TBYTE or TUSHORT
+ * @param radius  - window radius (1..127)
+ * @param mode    - type of border processing (look get_median_border)
+ * @param cval    - value for BORDER_CONSTANT
+ * @return filtered image (allocated here) of same type as `img` or NULL if failed
+ */
+FITSimage *get_median_int(FITSimage *img, size_t radius, border_mode mode, double cval){
+	if(!img || !img->data || img->naxis != 2 || img->totpix < 1) return NULL;
+	if(img->dtype != TBYTE && img->dtype != TUSHORT){
+		WARNX(_("Only 8- or 16-bit integer images supported"));
+		return NULL;
+	}
+	if(radius < 1 || radius > MEDINT_MAXRADIUS){
+		WARNX(_("Median radius should be from 1 to %d"), MEDINT_MAXRADIUS);
+		return NULL;
+	}
+	if(mode < BORDER_NONE || mode >= BORDER_COUNT){
+		WARNX(_("Wrong border mode"));
+		return NULL;
+	}
+	size_t w = img->naxes[0], h = img->naxes[1], totpix = img->totpix;
+	FITSimage *out = image_mksimilar(img);
+	if(!out) return NULL;
 #ifdef EBUG
 	double t0 = dtime();
 #endif
-	OMP_FOR(shared(inputima, med))
-	for(size_t x = radius; x < w - radius; ++x){
-		size_t xx, yy, xm = x + radius + 1, y, ymax = blksz - 1, xmin = x - radius;
-		Mediator* m = MediatorNew(fullsz);
-		// initial fill
-		for(yy = 0; yy < ymax; ++yy)
-			for(xx = xmin; xx < xm; ++xx)
-				MediatorInsert(m, inputima[xx + yy*w]);
-		ymax = 2*radius*w;
-		xmin += ymax;
-		xm += ymax;
-		ymax = h - radius;
-		size_t curpos = x + radius * w;
-		for(y = radius; y < ymax; ++y, xmin += w, xm += w, curpos += w){
-			for(xx = xmin; xx < xm; ++xx)
-				MediatorInsert(m, inputima[xx]);
-			double s, l, md, I = inputima[curpos];
-			md = MediatorStat(m, &s, &l);
-			s += ITM_EPSILON, l -= ITM_EPSILON;
-			if(s < md && md < l){
-				if(s < I && I < l) med[curpos] = I;
-				else med[curpos] = md;
-			}else{
-				if(radius > LARGEST_ADPMED_RADIUS)
-					med[curpos] = I;
-				else
-					med[curpos] = adp_med_5by5(img, x, y);
+	// convert data into uint16_t with minimal value equal to zero
+	uint16_t *vals = MALLOC(uint16_t, totpix), *med = MALLOC(uint16_t, totpix);
+	uint16_t *u16 = (uint16_t*) img->data;
+	uint8_t *u8 = (uint8_t*) img->data;
+	bool is8 = (img->dtype == TBYTE);
+	uint16_t min = is8 ? u8[0] : u16[0], max = min;
+	#define GETVAL(i)  (is8 ? (uint16_t)u8[i] : u16[i])
+	OMP_FOR(reduction(min:min) reduction(max:max))
+	for(size_t i = 0; i < totpix; ++i){
+		uint16_t v = GETVAL(i);
+		if(v < min) min = v;
+		if(v > max) max = v;
+	}
+	medint_pars p = {.radius = radius, .w = w, .h = h, .mode = (mode == BORDER_NONE) ? BORDER_REPLICATE : mode};
+	if(mode == BORDER_CONSTANT){
+		double cmax = is8 ? UINT8_MAX : UINT16_MAX;
+		uint16_t c = (uint16_t)((cval < 0.) ? 0. : (cval > cmax) ? cmax : cval);
+		if(c < min) min = c;
+		if(c > max) max = c;
+		p.cval = c - min;
+	}
+	OMP_FOR()
+	for(size_t i = 0; i < totpix; ++i) vals[i] = GETVAL(i) - min;
+	#undef GETVAL
+	int nbits = 1; // amount of bits for histogram
+	while(nbits < 16 && (1 << nbits) <= (max - min)) ++nbits;
+	p.finebits = (nbits + 1) / 2;
+	p.coarsebits = nbits - p.finebits;
+	p.NF = 1 << p.finebits; p.NC = 1 << p.coarsebits; p.NB = 1 << nbits;
+	p.vals = vals;
+	ssize_t *xmap = mkborder_map(w, radius, p.mode), *ymap = mkborder_map(h, radius, p.mode);
+	p.xmap = xmap; p.ymap = ymap;
+	// stripe width
+	// stripe width: fit memory budget, but not less than 2*radius to reduce overhead of borders
+	size_t colsz = p.NB + p.NC + 1, sw = MEDINT_MEMBUDGET / colsz, swmin = MAX(2*radius, MEDINT_MINSTRIPE);
+	sw = (sw > 2*radius + swmin) ? sw - 2*radius : swmin;
+	if(sw > MEDINT_MAXSTRIPE) sw = MEDINT_MAXSTRIPE;
+	size_t nthr = omp_get_max_threads(), wthr = (w + nthr - 1) / nthr;
+	if(sw > wthr) sw = MAX(wthr, swmin);
+	size_t nstripes = (w + sw - 1) / sw;
+	DBG("%d bits histogram (%zd x %zd), %zd stripes of width %zd", nbits, p.NC, p.NF, nstripes, sw);
+	OMP_FOR(schedule(dynamic))
+	for(size_t s = 0; s < nstripes; ++s){
+		size_t xs = s * sw, xe = MIN(xs + sw, w);
+		medint_stripe(&p, xs, xe, med);
+	}
+	FREE(xmap); FREE(ymap); FREE(vals);
+	// convert back
+	u16 = (uint16_t*) out->data;
+	u8 = (uint8_t*) out->data;
+	uint16_t *iu16 = (uint16_t*) img->data;
+	uint8_t *iu8 = (uint8_t*) img->data;
+	OMP_FOR()
+	for(size_t y = 0; y < h; ++y){
+		bool border = (mode == BORDER_NONE) && (y < radius || y + radius >= h);
+		for(size_t x = 0; x < w; ++x){
+			size_t i = y*w + x;
+			uint16_t v = med[i] + min;
+			if(mode == BORDER_NONE && (border || x < radius || x + radius >= w)) // leave unfiltered
+				v = is8 ? iu8[i] : iu16[i];
+			if(is8) u8[i] = (uint8_t)v;
+			else u16[i] = v;
+		}
+	}
+	FREE(med);
+	DBG("time for constant-time median filtering %zdx%zd of image %zdx%zd: %gs", 2*radius+1, 2*radius+1,
+		w, h, dtime() - t0);
+	return out;
+}
+
+/*
+ * Median filtering of image cubes (time series). Planes are pushed one by one, filtered planes
+ * are returned with delay of `tradius` planes, so only window of planes is kept in memory:
+ * last 2*tradius+1 planes are stored in ring buffer. Temporal median (sradius == 0) selects
+ * median of each pixel from this ring by sorting networks on wires of MEDNET_TILE pixels (running
+ * median for each pixel would need more than twice as much memory); 3-D median slides Mediator
+ * along each row.
+ * Edge planes (and edge pixels for 3-D median) are replicated.
+ */
+// max length of temporal window sorted by network (Batcher's network fits MEDNET_MAXPAIRS)
+#define CUBEMED_MAXNET      (31)
+
+struct cubemedian_{
+	size_t w, h, npix;      // plane size
+	size_t tr, sr;          // temporal and spatial radius
+	size_t nwin;            // amount of planes in window
+	size_t pushed;          // amount of pushed planes
+	size_t done;            // amount of returned planes
+	double *planes;         // ring buffer of planes
+};
+
+/**
+ * @brief cubemedian_new - create new filter for cube with planes of size `w`x`h`
+ * @param w, h    - plane size
+ * @param tradius - radius of window along time axis
+ * @param sradius - radius of window in plane (0 for temporal median only)
+ * @return filter structure or NULL if failed
+ */
+cubemedian *cubemedian_new(size_t w, size_t h, size_t tradius, size_t sradius){
+	if(w < 1 || h < 1){
+		WARNX(_("Wrong image size"));
+		return NULL;
+	}
+	cubemedian *cm = MALLOC(cubemedian, 1);
+	cm->w = w; cm->h = h; cm->npix = w * h;
+	cm->tr = tradius; cm->sr = sradius;
+	cm->nwin = 2*tradius + 1;
+	cm->planes = malloc(cm->npix * cm->nwin * sizeof(double));
+	if(!cm->planes){
+		WARNX(_("Can't allocate memory for cube filter"));
+		FREE(cm);
+		return NULL;
+	}
+	return cm;
+}
+
+void cubemedian_free(cubemedian **cm){
+	if(!cm || !*cm) return;
+	FREE((*cm)->planes);
+	FREE(*cm);
+}
+
+/**
+ * @brief median3d - calculate 3-D (or temporal if cm->sr == 0) median for plane `t`
+ * @param cm (i)  - filter
+ * @param t       - index of plane
+ * @param out (o) - output plane
+ */
+static void median3d(cubemedian *cm, size_t t, double *out){
+	size_t w = cm->w, h = cm->h, sr = cm->sr, nwin = cm->nwin, bs = 2*sr + 1;
+	int N = (int)(bs * bs * nwin);
+	const double *pl[nwin];
+	for(size_t k = 0; k < nwin; ++k){
+		ssize_t idx = (ssize_t)(t + k) - (ssize_t)cm->tr;
+		if(idx < 0) idx = 0;
+		else if(idx >= (ssize_t)cm->pushed) idx = cm->pushed - 1;
+		pl[k] = &cm->planes[(idx % nwin) * cm->npix];
+	}
+	if(sr == 0){ // temporal median: window of each pixel is `nwin` values of the same pixel
+		sortnet net;
+		if(nwin <= CUBEMED_MAXNET) mksortnet((int)nwin, &net);
+		size_t ntiles = (cm->npix + MEDNET_TILE - 1) / MEDNET_TILE;
+		OMP_FOR()
+		for(size_t tl = 0; tl < ntiles; ++tl){
+			size_t first = tl * MEDNET_TILE, T = MIN(MEDNET_TILE, cm->npix - first);
+			if(nwin > CUBEMED_MAXNET){ // too long window: select median for each pixel
+				double buf[nwin];
+				for(size_t i = first; i < first + T; ++i){
+					for(size_t k = 0; k < nwin; ++k) buf[k] = pl[k][i];
+					out[i] = calc_median_buf(buf, nwin, buf);
+				}
+				continue;
 			}
+			// wire `k` holds values of tile pixels in plane `k` of window
+			double buf[CUBEMED_MAXNET][MEDNET_TILE], *wires[CUBEMED_MAXNET];
+			for(size_t k = 0; k < nwin; ++k){
+				wires[k] = buf[k];
+				memcpy(buf[k], &pl[k][first], T * sizeof(double));
+			}
+			sort_wires(wires, &net, T);
+			memcpy(&out[first], buf[nwin / 2], T * sizeof(double));
+		}
+		return;
+	}
+	OMP_FOR()
+	for(size_t y = 0; y < h; ++y){
+		Mediator *m = MediatorNew(N);
+		size_t rows[bs];
+		for(size_t j = 0; j < bs; ++j){
+			ssize_t yy = (ssize_t)(y + j) - (ssize_t)sr;
+			rows[j] = (yy < 0) ? 0 : (yy >= (ssize_t)h) ? (h - 1) * w : yy * w;
 		}
+		// insert column `x` of window into Mediator
+		#define INSCOL(x)  do{ssize_t X = (x); if(X < 0) X = 0; else if(X >= (ssize_t)w) X = w - 1; \
+			for(size_t k = 0; k < nwin; ++k) for(size_t j = 0; j < bs; ++j) MediatorInsert(m, pl[k][rows[j] + X]);}while(0)
+		for(ssize_t x = -(ssize_t)sr; x < (ssize_t)sr; ++x) INSCOL(x);
+		for(size_t x = 0; x < w; ++x){
+			INSCOL((ssize_t)(x + sr));
+			out[y * w + x] = MediatorMedian(m);
+		}
+		#undef INSCOL
 		FREE(m);
 	}
-	DBG("time for adadptive median filtering %zdx%zd of image %zdx%zd: %gs", blksz, blksz, w, h,
-		dtime() - t0);
-	return out;
 }
+
+/**
+ * @brief cubemedian_push - add next plane of cube
+ * @param cm (i)    - filter
+ * @param plane (i) - plane data
+ * @param out (o)   - output plane (filtered plane number `pushed - tradius - 1`)
+ * @return TRUE if `out` was filled
+ */
+bool cubemedian_push(cubemedian *cm, const double *plane, double *out){
+	if(!cm || !plane || !out) return FALSE;
+	bool ready = (cm->pushed >= cm->tr);
+	memcpy(&cm->planes[(cm->pushed % cm->nwin) * cm->npix], plane, cm->npix * sizeof(double));
+	++cm->pushed;
+	if(ready) median3d(cm, cm->done++, out);
+	return ready;
+}
+
+/**
+ * @brief cubemedian_flush - get next filtered plane after all planes were pushed
+ * @param cm (i)  - filter
+ * @param out (o) - output plane
+ * @return TRUE if `out` was filled, FALSE if there's no more planes
+ */
+bool cubemedian_flush(cubemedian *cm, double *out){
+	if(!cm || !out || cm->done >= cm->pushed) return FALSE;
+	median3d(cm, cm->done++, out);
+	return TRUE;
+}
+
+/**
+ * @brief get_cube_median - temporal or 3-D median filtering of cube in memory
+ * @param cube (i) - image with 3 dimensions (higher dimensions are treated as planes too)
+ * @param tradius  - radius of window along time axis
+ * @param sradius  - radius of window in plane (0 for temporal median only)
+ * @return filtered cube (FLOAT_IMG) or NULL if failed
+ */
+FITSimage *get_cube_median(FITSimage *cube, size_t tradius, size_t sradius){
+	if(!cube || !cube->data || cube->naxis < 2){
+		WARNX(_("Wrong image"));
+		return NULL;
+	}
+	size_t w = cube->naxes[0], h = cube->naxes[1], npix = w * h, nplanes = cube->totpix / npix;
+	initomp();
+	cubemedian *cm = cubemedian_new(w, h, tradius, sradius);
+	if(!cm) return NULL;
+	FITSimage *out = image_new(cube->naxis, cube->naxes, FLOAT_IMG);
+	if(!out || !out->data){
+		WARNX(_("Can't create output image"));
+		if(out) image_free(&out);
+		cubemedian_free(&cm);
+		return NULL;
+	}
+#ifdef EBUG
+	double t0 = dtime();
 #endif
+	double *plane = MALLOC(double, npix), *oplane = MALLOC(double, npix);
+	float *odata = (float*)out->data;
+	size_t p = 0, o = 0;
+	// convert filtered plane into output image
+	#define STORE()  do{float *op = &odata[npix * o++]; \
+		OMP_FOR() for(size_t i = 0; i < npix; ++i) op[i] = (float)oplane[i];}while(0)
+	for(; p < nplanes; ++p){
+		image_pix2double(cube, p * npix, npix, plane);
+		if(cubemedian_push(cm, plane, oplane)) STORE();
+	}
+	while(cubemedian_flush(cm, oplane)) STORE();
+	#undef STORE
+	FREE(plane); FREE(oplane);
+	cubemedian_free(&cm);
+	DBG("time for median filtering of cube %zdx%zdx%zd: %gs", w, h, nplanes, dtime() - t0);
+	return out;
+}
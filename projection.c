@@ -0,0 +1,170 @@
+/*
+ * This file is part of the FITSmaniplib project.
+ * Copyright 2019  Edward V. Emelianov <edward.emelianoff@gmail.com>, <eddy@sao.ru>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "FITSmanip.h"
+#include "local.h"
+
+/**************************************************************************************
+ *                              Image projections                                     *
+ **************************************************************************************/
+/*
+ * Row and column sums/means/medians (for overscan correction, profiles etc)
+ * Columns are processed by vertical stripes with width of several cache lines,
+ * so image is always read row by row
+ */
+
+// width of stripe for column sums (accumulators should fit L1)
+#define PROJ_SUMBLK     (256)
+// width of stripe for column medians (stripe copied into buffer)
+#define PROJ_MEDBLK     (16)
+// amount of rows processed by one thread with common buffer
+#define PROJ_ROWBLK     (32)
+// max amount of iterations for sigma-clipped mean
+#define CLIPMEAN_MAXITER (5)
+
+/**
+ * @brief clipmean - sigma-clipped mean of array
+ * @param buf (io) - data array (would be changed!)
+ * @param n        - its length
+ * @param nsigma   - clipping limit (in STD)
+ * @return mean value of data after clipping
+ */
+static double clipmean(double *buf, size_t n, double nsigma){
+    double mean = 0.;
+    for(int iter = 0; iter <= CLIPMEAN_MAXITER; ++iter){
+        double sum = 0., sum2 = 0.;
+        for(size_t i = 0; i < n; ++i){
+            sum += buf[i];
+            sum2 += buf[i] * buf[i];
+        }
+        mean = sum / n;
+        if(iter == CLIPMEAN_MAXITER) break;
+        double s2 = sum2 / n - mean * mean;
+        double thres = (s2 > 0.) ? nsigma * sqrt(s2) : 0.;
+        size_t m = 0;
+        for(size_t i = 0; i < n; ++i)
+            if(fabs(buf[i] - mean) <= thres) buf[m++] = buf[i];
+        if(m == n || m == 0) break; // nothing to clip or all clipped
+        n = m;
+    }
+    return mean;
+}
+
+// projection of rows (one value per row)
+static void proj_rows(const doubleimage *im, const imregion *r, proj_type type, double nsigma, double *out){
+    size_t W = im->width, nblk = (r->h + PROJ_ROWBLK - 1) / PROJ_ROWBLK;
+    OMP_FOR()
+    for(size_t b = 0; b < nblk; ++b){
+        size_t ys = b * PROJ_ROWBLK, ye = MIN(ys + PROJ_ROWBLK, r->h);
+        double *buf = NULL;
+        if(type == PROJ_CLIPMEAN || type == PROJ_MEDIAN) buf = MALLOC(double, r->w);
+        for(size_t y = ys; y < ye; ++y){
+            const double *in = &im->data[(r->y0 + y) * W + r->x0];
+            if(type == PROJ_MEDIAN){
+                out[y] = calc_median_buf(in, r->w, buf);
+            }else if(buf){
+                memcpy(buf, in, sizeof(double) * r->w);
+                out[y] = clipmean(buf, r->w, nsigma);
+            }else{
+                double sum = 0.;
+                for(size_t x = 0; x < r->w; ++x) sum += in[x];
+                out[y] = (type == PROJ_MEAN) ? sum / r->w : sum;
+            }
+        }
+        FREE(buf);
+    }
+}
+
+// projection of columns (one value per column)
+static void proj_columns(const doubleimage *im, const imregion *r, proj_type type, double nsigma, double *out){
+    size_t W = im->width;
+    if(type == PROJ_SUM || type == PROJ_MEAN){ // accumulate rows in stripe
+        size_t nblk = (r->w + PROJ_SUMBLK - 1) / PROJ_SUMBLK;
+        OMP_FOR()
+        for(size_t b = 0; b < nblk; ++b){
+            size_t xs = b * PROJ_SUMBLK, bw = MIN(PROJ_SUMBLK, r->w - xs);
+            double *o = &out[xs];
+            const double *in = &im->data[r->y0 * W + r->x0 + xs];
+            for(size_t y = 0; y < r->h; ++y, in += W)
+                for(size_t x = 0; x < bw; ++x) o[x] += in[x];
+            if(type == PROJ_MEAN)
+                for(size_t x = 0; x < bw; ++x) o[x] /= r->h;
+        }
+        return;
+    }
+    // transpose stripe into buffer, then reduce each column
+    size_t nblk = (r->w + PROJ_MEDBLK - 1) / PROJ_MEDBLK, H = r->h;
+    OMP_FOR()
+    for(size_t b = 0; b < nblk; ++b){
+        size_t xs = b * PROJ_MEDBLK, bw = MIN(PROJ_MEDBLK, r->w - xs);
+        double *buf = MALLOC(double, H * bw);
+        const double *in = &im->data[r->y0 * W + r->x0 + xs];
+        for(size_t y = 0; y < H; ++y, in += W)
+            for(size_t x = 0; x < bw; ++x) buf[x * H + y] = in[x];
+        for(size_t x = 0; x < bw; ++x){
+            double *col = &buf[x * H];
+            out[xs + x] = (type == PROJ_MEDIAN) ? calc_median_buf(col, H, col) : clipmean(col, H, nsigma);
+        }
+        FREE(buf);
+    }
+}
+
+/**
+ * @brief dbl_projection - reduce image (or its part) along rows or columns
+ * @param im (i)  - input image
+ * @param axis    - PROJ_ROWS to get one value per row, PROJ_COLUMNS - one value per column
+ * @param type    - type of reduction: sum, mean, median or sigma-clipped mean
+ * @param reg (i) - region of image (NULL for whole image)
+ * @param nsigma  - clipping limit (in STD) for PROJ_CLIPMEAN
+ * @return array (allocated here) of length `reg->h` for rows or `reg->w` for columns; NULL if failed
+ */
+double *dbl_projection(const doubleimage *im, proj_axis axis, proj_type type, const imregion *reg, double nsigma){
+    if(!im || !im->data || type <= PROJ_WRONG || type >= PROJ_COUNT) return NULL;
+    imregion r = {0, 0, im->width, im->height};
+    if(reg){
+        if(reg->w < 1 || reg->h < 1 || reg->x0 + reg->w > im->width || reg->y0 + reg->h > im->height){
+            WARNX(_("Region is out of image"));
+            return NULL;
+        }
+        r = *reg;
+    }
+    if(type == PROJ_CLIPMEAN && nsigma <= 0.){
+        WARNX(_("Clipping limit should be positive"));
+        return NULL;
+    }
+    double *out = NULL;
+#ifdef EBUG
+    double t0 = dtime();
+#endif
+    initomp();
+    switch(axis){
+        case PROJ_ROWS:
+            out = MALLOC(double, r.h);
+            proj_rows(im, &r, type, nsigma, out);
+        break;
+        case PROJ_COLUMNS:
+            out = MALLOC(double, r.w);
+            proj_columns(im, &r, type, nsigma, out);
+        break;
+        default:
+            WARNX(_("Wrong projection axis"));
+            return NULL;
+    }
+    DBG("time for projection of %zdx%zd region: %gs", r.w, r.h, dtime() - t0);
+    return out;
+}
@@ -0,0 +1,233 @@
+/*
+ * This file is part of the FITSmaniplib project.
+ * Copyright 2019  Edward V. Emelianov <edward.emelianoff@gmail.com>, <eddy@sao.ru>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "FITSmanip.h"
+#include "local.h"
+
+/**************************************************************************************
+ *                          Multi-resolution image pyramid                            *
+ **************************************************************************************/
+/*
+ * Level `k` of pyramid is image reduced 2^k times by 2x2 blocks of level `k-1` (level 0
+ * is original image; odd last row/column is dropped). Levels are calculated in one
+ * traversal of image: it's processed by stripes of 2^n rows, each stripe gives 2^(n-k)
+ * rows of level `k`, so rows of previous level are still in cache when next level is
+ * calculated. Stripes are independent and processed in parallel. Levels deeper than
+ * `n` are calculated the same way from level `n` (which is 4^n times smaller).
+ * For PYRAMID_MEDIAN each level is median of 2x2 block of previous level (so for
+ * levels > 1 it's median of medians).
+ */
+
+// max amount of pyramid levels
+#define PYRAMID_MAXLEVELS   (30)
+// max amount of levels calculated by one traversal (stripe of 2^PYRAMID_PASSLEVELS rows)
+#define PYRAMID_PASSLEVELS  (5)
+
+// reduce pair of rows `a` and `b` into `o` (`w` output pixels)
+static void reduce_rows(const double *a, const double *b, double *o, size_t w, pyramid_type type){
+    switch(type){
+        case PYRAMID_MEAN:
+            OMP_SIMD()
+            for(size_t x = 0; x < w; ++x)
+                o[x] = 0.25 * ((a[2*x] + a[2*x+1]) + (b[2*x] + b[2*x+1]));
+        break;
+        case PYRAMID_MAX:
+            OMP_SIMD()
+            for(size_t x = 0; x < w; ++x){
+                double m1 = (a[2*x] > a[2*x+1]) ? a[2*x] : a[2*x+1];
+                double m2 = (b[2*x] > b[2*x+1]) ? b[2*x] : b[2*x+1];
+                o[x] = (m1 > m2) ? m1 : m2;
+            }
+        break;
+        case PYRAMID_MEDIAN: // mean of two middle values
+            OMP_SIMD()
+            for(size_t x = 0; x < w; ++x){
+                double a0 = a[2*x], a1 = a[2*x+1], b0 = b[2*x], b1 = b[2*x+1];
+                double lo1 = (a0 < a1) ? a0 : a1, hi1 = (a0 < a1) ? a1 : a0;
+                double lo2 = (b0 < b1) ? b0 : b1, hi2 = (b0 < b1) ? b1 : b0;
+                double lo = (lo1 > lo2) ? lo1 : lo2, hi = (hi1 < hi2) ? hi1 : hi2;
+                o[x] = 0.5 * (lo + hi);
+            }
+        break;
+        default:
+        break;
+    }
+}
+
+void dblpyramid_free(dblpyramid **p){
+    if(!p || !*p) return;
+    for(size_t i = 0; i < (*p)->nlevels; ++i)
+        if((*p)->levels[i]) doubleimage_free(&(*p)->levels[i]);
+    FREE((*p)->levels);
+    FREE(*p);
+}
+
+/**
+ * @brief pyramid_pass - calculate `nlev` levels of pyramid by stripes of 2^nlev rows
+ * @param img (i)     - image (or NULL)
+ * @param dimg (i)    - double image (if `img` is NULL)
+ * @param w, h        - image size
+ * @param levels (io) - levels (allocated)
+ * @param nlev        - amount of levels
+ * @param type        - type of block reduction
+ * @return FALSE if failed
+ */
+static bool pyramid_pass(const FITSimage *img, const doubleimage *dimg, size_t w, size_t h,
+                         doubleimage **levels, size_t nlev, pyramid_type type){
+    size_t stripe = (size_t)1 << nlev, nstripes = (h + stripe - 1) / stripe;
+    bool good = TRUE;
+    OMP_FOR()
+    for(size_t s = 0; s < nstripes; ++s){
+        double *buf = img ? MALLOC(double, 2 * w) : NULL; // two rows of converted image
+        // first level
+        size_t w1 = levels[0]->width, h1 = levels[0]->height;
+        size_t r0 = s * (stripe / 2), r1 = MIN(r0 + stripe / 2, h1);
+        for(size_t r = r0; r < r1; ++r){
+            const double *a, *b;
+            if(img){
+                if(!image_pix2double_block(img, 2 * r * w, 2 * w, buf)){
+                    good = FALSE;
+                    break;
+                }
+                a = buf; b = buf + w;
+            }else{
+                a = &dimg->data[2 * r * w]; b = a + w;
+            }
+            reduce_rows(a, b, &levels[0]->data[r * w1], w1, type);
+        }
+        // other levels: from rows of previous level in this stripe
+        for(size_t k = 1; k < nlev; ++k){
+            const doubleimage *prev = levels[k-1];
+            doubleimage *cur = levels[k];
+            size_t n = stripe >> (k+1), wp = prev->width;
+            r0 = s * n; r1 = MIN(r0 + n, cur->height);
+            for(size_t r = r0; r < r1; ++r){
+                const double *a = &prev->data[2 * r * wp];
+                reduce_rows(a, a + wp, &cur->data[r * cur->width], cur->width, type);
+            }
+        }
+        FREE(buf);
+    }
+    return good;
+}
+
+/**
+ * @brief build_pyramid - calculate pyramid of image given by FITSimage or doubleimage
+ * @param img (i)  - image (or NULL)
+ * @param dimg (i) - double image (if `img` is NULL)
+ * @param w, h     - image size
+ * @param type     - type of block reduction
+ * @param nlevels  - amount of levels (0 - while level is larger than 1x1)
+ * @return pyramid or NULL if failed
+ */
+static dblpyramid *build_pyramid(const FITSimage *img, const doubleimage *dimg, size_t w, size_t h,
+                                 pyramid_type type, size_t nlevels){
+    if(type <= PYRAMID_WRONG || type >= PYRAMID_COUNT){
+        WARNX(_("Wrong type of pyramid"));
+        return NULL;
+    }
+    size_t maxlev = 0;
+    while(maxlev < PYRAMID_MAXLEVELS && (w >> (maxlev+1)) && (h >> (maxlev+1))) ++maxlev;
+    if(maxlev == 0){
+        WARNX(_("Image is too small for pyramid"));
+        return NULL;
+    }
+    if(nlevels == 0 || nlevels > maxlev) nlevels = maxlev;
+    dblpyramid *P = MALLOC(dblpyramid, 1);
+    P->nlevels = nlevels;
+    P->levels = MALLOC(doubleimage*, nlevels);
+    for(size_t k = 0; k < nlevels; ++k)
+        P->levels[k] = doubleimage_new(w >> (k+1), h >> (k+1));
+#ifdef EBUG
+    double t0 = dtime();
+#endif
+    initomp();
+    // deep levels are calculated by next passes from last level of previous pass
+    size_t nlev = MIN(nlevels, PYRAMID_PASSLEVELS);
+    bool good = pyramid_pass(img, dimg, w, h, P->levels, nlev, type);
+    for(size_t k = nlev; good && k < nlevels; k += nlev){
+        const doubleimage *src = P->levels[k-1];
+        nlev = MIN(nlevels - k, PYRAMID_PASSLEVELS);
+        good = pyramid_pass(NULL, src, src->width, src->height, &P->levels[k], nlev, type);
+    }
+    DBG("time for pyramid with %zd levels: %gs", nlevels, dtime() - t0);
+    if(!good) dblpyramid_free(&P);
+    return P;
+}
+
+/**
+ * @brief dbl_pyramid - make multi-resolution pyramid of double image
+ * @param im (i)   - image
+ * @param type     - type of 2x2 block reduction: mean, max or median
+ * @param nlevels  - amount of levels (0 - all levels down to size 1 pixel)
+ * @return pyramid (allocated here; levels[k] is reduced 2^(k+1) times) or NULL if failed
+ */
+dblpyramid *dbl_pyramid(const doubleimage *im, pyramid_type type, size_t nlevels){
+    if(!im || !im->data) return NULL;
+    return build_pyramid(NULL, im, im->width, im->height, type, nlevels);
+}
+
+/**
+ * @brief image_pyramid - make multi-resolution pyramid of image of any type
+ *      (image rows are converted to double on the fly)
+ * @param img (i)  - 2-dimensional image
+ * @param type     - type of 2x2 block reduction: mean, max or median
+ * @param nlevels  - amount of levels (0 - all levels down to size 1 pixel)
+ * @return pyramid (allocated here; levels[k] is reduced 2^(k+1) times) or NULL if failed
+ */
+dblpyramid *image_pyramid(const FITSimage *img, pyramid_type type, size_t nlevels){
+    if(!img || !img->data || img->naxis != 2){
+        WARNX(_("Pyramid can be built only for 2-dimensional images"));
+        return NULL;
+    }
+    return build_pyramid(img, NULL, img->naxes[0], img->naxes[1], type, nlevels);
+}
+
+/**
+ * @brief FITS_addpyramid - add levels of pyramid as new image HDUs (FLOAT_IMG)
+ *      with EXTNAME='PYRAMIDk' and PYRSCALE equal to reduction factor
+ * @param fits (io) - FITS file (write it by FITS_write)
+ * @param P (i)     - pyramid
+ * @return FALSE if failed
+ */
+bool FITS_addpyramid(FITS *fits, const dblpyramid *P){
+    if(!fits || !P) return FALSE;
+    for(size_t k = 0; k < P->nlevels; ++k){
+        const doubleimage *lev = P->levels[k];
+        long naxes[2] = {lev->width, lev->height};
+        FITSimage *img = image_new(2, naxes, FLOAT_IMG);
+        if(!img) return FALSE;
+        float *d = (float*)img->data;
+        OMP_FOR()
+        for(size_t i = 0; i < lev->totpix; ++i) d[i] = (float)lev->data[i];
+        FITSHDU *hdu = FITS_addHDU(fits);
+        if(!hdu){
+            image_free(&img);
+            return FALSE;
+        }
+        memset(hdu, 0, sizeof(FITSHDU));
+        hdu->hdutype = IMAGE_HDU;
+        hdu->contents.image = img;
+        char rec[FLEN_CARD];
+        snprintf(rec, FLEN_CARD, "EXTNAME = 'PYRAMID%zd' / level of image pyramid", k + 1);
+        keylist_add_record(&hdu->keylist, rec, 1);
+        snprintf(rec, FLEN_CARD, "PYRSCALE= %zd / reduction factor of pyramid level", (size_t)2 << k);
+        keylist_add_record(&hdu->keylist, rec, 1);
+    }
+    return TRUE;
+}